@@ -0,0 +1,71 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include <avr/pgmspace.h>
+
+#include "axis_table.h"
+
+#define AXIS_TABLE_KNOT(range_resistor, knot) AXIS_POSITION(range_resistor, (knot) * AXIS_TABLE_STEP)
+
+#define AXIS_TABLE_KNOTS_8(range_resistor, knot) \
+    AXIS_TABLE_KNOT(range_resistor, (knot) + 0), AXIS_TABLE_KNOT(range_resistor, (knot) + 1), \
+    AXIS_TABLE_KNOT(range_resistor, (knot) + 2), AXIS_TABLE_KNOT(range_resistor, (knot) + 3), \
+    AXIS_TABLE_KNOT(range_resistor, (knot) + 4), AXIS_TABLE_KNOT(range_resistor, (knot) + 5), \
+    AXIS_TABLE_KNOT(range_resistor, (knot) + 6), AXIS_TABLE_KNOT(range_resistor, (knot) + 7)
+
+#define AXIS_TABLE_RANGE(range_resistor) { \
+    AXIS_TABLE_KNOTS_8(range_resistor, 0), AXIS_TABLE_KNOTS_8(range_resistor, 8), \
+    AXIS_TABLE_KNOTS_8(range_resistor, 16), AXIS_TABLE_KNOTS_8(range_resistor, 24), \
+    AXIS_TABLE_KNOTS_8(range_resistor, 32), AXIS_TABLE_KNOTS_8(range_resistor, 40), \
+    AXIS_TABLE_KNOTS_8(range_resistor, 48), AXIS_TABLE_KNOTS_8(range_resistor, 56), \
+    AXIS_TABLE_KNOT(range_resistor, 64) }
+
+#if AXIS_TABLE_KNOTS != 65
+#error "AXIS_TABLE_RANGE() has to be adjusted to the changed AXIS_TABLE_STEP_BITS"
+#endif
+
+/**
+ * Axis position for each range at every AXIS_TABLE_STEP-th ADC code.
+ * Generated by the compiler from the voltage divider equation in axis_table.h.
+ */
+static const PROGMEM int16_t axis_position_table[4][AXIS_TABLE_KNOTS] = {
+    AXIS_TABLE_RANGE(AXIS_RANGE_0_RESISTOR_OHM),
+    AXIS_TABLE_RANGE(AXIS_RANGE_1_RESISTOR_OHM),
+    AXIS_TABLE_RANGE(AXIS_RANGE_2_RESISTOR_OHM),
+    AXIS_TABLE_RANGE(AXIS_RANGE_3_RESISTOR_OHM),
+};
+
+
+int16_t axis_position(const uint8_t range, const uint16_t oversampled_adc_value) {
+    const int16_t *knots = &axis_position_table[range & 0x03][oversampled_adc_value >> AXIS_TABLE_FRACTION_BITS];
+    const uint8_t fraction = oversampled_adc_value & ((1 << AXIS_TABLE_FRACTION_BITS) - 1);
+    const int16_t lower_knot = pgm_read_word(knots);
+    const int16_t upper_knot = pgm_read_word(knots + 1);
+    /* Interpolate linearly between both knots. The knots can be far apart for small ADC codes,
+     * so the product needs more than 16 bits. This is a single hardware multiplication.
+     */
+    return lower_knot + (int16_t) (((int32_t) (upper_knot - lower_knot) * fraction) >> AXIS_TABLE_FRACTION_BITS);
+}
+
+
+uint16_t axis_position_step(const uint8_t range, const uint16_t oversampled_adc_value) {
+    const int16_t *knots = &axis_position_table[range & 0x03][oversampled_adc_value >> AXIS_TABLE_FRACTION_BITS];
+    const int16_t difference = (int16_t) pgm_read_word(knots) - (int16_t) pgm_read_word(knots + 1);
+    // The knots are at most 4094 apart, so the difference per ADC code in 8.8 fixed point fits into 16 bits.
+    return (uint16_t) (difference < 0 ? -difference : difference) << (8 - AXIS_TABLE_STEP_BITS);
+}
@@ -0,0 +1,256 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "buttons.h"
+#include "clock.h"
+#include "joystick_config.h"
+
+#if BUTTON_COUNT != 4 && BUTTON_COUNT != 8
+#error "BUTTON_COUNT must be 4 or 8"
+#endif
+
+#if SOF_TIMEBASE && BUTTON_COUNT == 8 && BUTTON_DEBOUNCE_FAST_ACCEPT
+#error "With SOF_TIMEBASE, pin change interrupt 2 is the USB interrupt, so buttons 5-8 can not use it"
+#endif
+
+/**
+ * One bit for each button.
+ */
+#define BUTTON_MASK ((uint8_t) (_BV(BUTTON_COUNT) - 1))
+
+#define memory_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+/**
+ * Integrating debouncer of a button. The integrator counts up for each clock tick the button is seen pressed and
+ * down for each tick it is seen released, limited to 0 and BUTTON_DEBOUNCE_TICKS. The debounced state changes when
+ * the integrator reaches the limit opposite to the debounced state, so a bounce has to last BUTTON_DEBOUNCE_TICKS
+ * ticks to be taken as an edge.
+ * 
+ * With BUTTON_DEBOUNCE_FAST_ACCEPT, the first edge of a settled button is taken right away by the pin change
+ * interrupt. The integrator then jumps to the limit of the new state, which rejects the following bounces.
+ * A button counts as settled, once no edge was accepted for BUTTON_DEBOUNCE_TICKS ticks and the integrator
+ * agrees with the debounced state.
+ */
+struct button_debouncer_t {
+    uint8_t integrator;
+    uint8_t holdoff;
+};
+
+static struct button_debouncer_t debouncer[BUTTON_COUNT];
+
+/**
+ * Returns the current level of all buttons, one bit per button, set if pressed.
+ * The buttons pull their pins low, when pressed. Buttons 1-4 are read from Port C 0-3, buttons 5-8 from
+ * Port D 1, 5, 6 and 7. Port D 5-7 already are at the bit position of their button, so each port is read only once
+ * and only Port D 1 needs to be moved.
+ */
+static inline uint8_t read_button_pins() {
+#if BUTTON_COUNT == 8
+    const uint8_t port_d = ~PIND;
+    return (~PINC & 0x0F) | (port_d & (_BV(PIND5) | _BV(PIND6) | _BV(PIND7))) | ((port_d << 3) & _BV(4));
+#else
+    return ~PINC & 0x0F;
+#endif
+}
+
+/**
+ * Debounced button state, one bit per button, set if pressed.
+ */
+static volatile uint8_t debounced_buttons;
+
+/**
+ * Buttons that may accept their next edge right away.
+ */
+static uint8_t settled_buttons = BUTTON_MASK;
+
+/**
+ * Buttons pressed since they were last read by buttons_read().
+ */
+static volatile uint8_t latched_presses;
+
+static uint8_t press_counts[BUTTON_COUNT];
+
+/**
+ * Times of the most recent debounced edges, as given by clock_micros().
+ * edge_sequence is incremented for each accepted edge, to detect edges accepted while copying the times.
+ */
+static uint32_t press_time[BUTTON_COUNT];
+static uint32_t release_time[BUTTON_COUNT];
+static volatile uint8_t edge_sequence;
+
+/**
+ * Time of the latest debouncer update, as given by clock_micros().
+ */
+static uint32_t sample_time;
+
+/**
+ * Edge times relative to the latest sent report, as returned by buttons_get_edges(). Only used by the main loop.
+ */
+static struct button_edges_t report_edges;
+
+
+/**
+ * Flips the debounced state of the given buttons, at the given time.
+ */
+static void accept_edges(const uint8_t changed_buttons, const uint32_t time) {
+    const uint8_t buttons = debounced_buttons ^ changed_buttons;
+    debounced_buttons = buttons;
+    latched_presses |= changed_buttons & buttons;
+    for (uint8_t button = 0; button < BUTTON_COUNT; ++button) {
+        const uint8_t button_bit = _BV(button);
+        if (changed_buttons & button_bit) {
+            debouncer[button].holdoff = BUTTON_DEBOUNCE_TICKS;
+            if (buttons & button_bit) {
+                debouncer[button].integrator = BUTTON_DEBOUNCE_TICKS;
+                ++press_counts[button];
+                press_time[button] = time;
+            } else {
+                debouncer[button].integrator = 0;
+                release_time[button] = time;
+            }
+        }
+    }
+    settled_buttons &= ~changed_buttons;
+    ++edge_sequence;
+}
+
+
+#if BUTTON_DEBOUNCE_FAST_ACCEPT
+/**
+ * Pin change interrupts of all button pins.
+ */
+#if BUTTON_COUNT == 8
+#define BUTTON_PIN_CHANGE_INTERRUPTS (_BV(PCIE1) | _BV(PCIE2))
+#else
+#define BUTTON_PIN_CHANGE_INTERRUPTS _BV(PCIE1)
+#endif
+
+ISR(PCINT1_vect, ISR_NOBLOCK) {
+    /* Called on every level change of a button pin. Runs with interrupts enabled, to not delay the USB interrupt.
+     * Disable the pin change interrupts and the debouncer tick meanwhile, so that neither this routine nor the
+     * debouncer interrupts it. Changes in the meantime keep their interrupt flags set and are handled right after
+     * returning.
+     */
+    PCICR &= ~BUTTON_PIN_CHANGE_INTERRUPTS;
+    TIMSK0 &= ~_BV(OCIE0B);
+    const uint8_t changed_buttons = (read_button_pins() ^ debounced_buttons) & settled_buttons;
+    if (changed_buttons) {
+        const uint32_t time = clock_micros();
+        accept_edges(changed_buttons, time);
+        sample_time = time;
+    }
+    TIMSK0 |= _BV(OCIE0B);
+    PCICR |= BUTTON_PIN_CHANGE_INTERRUPTS;
+}
+
+#if BUTTON_COUNT == 8
+// Buttons 5-8 on Port D are handled just like the buttons on Port C.
+ISR(PCINT2_vect, ISR_ALIASOF(PCINT1_vect));
+#endif
+#endif
+
+
+void buttons_debounce_tick() {
+#if BUTTON_DEBOUNCE_FAST_ACCEPT
+    PCICR &= ~BUTTON_PIN_CHANGE_INTERRUPTS;
+#endif
+    const uint8_t pressed = read_button_pins();
+    const uint8_t buttons = debounced_buttons;
+    uint8_t changed_buttons = 0;
+    uint8_t settled = 0;
+    for (uint8_t button = 0; button < BUTTON_COUNT; ++button) {
+        const uint8_t button_bit = _BV(button);
+        struct button_debouncer_t *button_debouncer = &debouncer[button];
+        if (pressed & button_bit) {
+            if (button_debouncer->integrator < BUTTON_DEBOUNCE_TICKS) {
+                ++button_debouncer->integrator;
+            }
+        } else if (button_debouncer->integrator > 0) {
+            --button_debouncer->integrator;
+        }
+        if (button_debouncer->holdoff > 0) {
+            --button_debouncer->holdoff;
+        }
+        // The limit the integrator has while it agrees with the debounced state.
+        const uint8_t agreeing_limit = (buttons & button_bit) ? BUTTON_DEBOUNCE_TICKS : 0;
+        if (button_debouncer->integrator == BUTTON_DEBOUNCE_TICKS - agreeing_limit) {
+            changed_buttons |= button_bit;
+        } else if (button_debouncer->integrator == agreeing_limit && button_debouncer->holdoff == 0) {
+            settled |= button_bit;
+        }
+    }
+    settled_buttons = settled;
+    const uint32_t time = clock_micros();
+    if (changed_buttons) {
+        accept_edges(changed_buttons, time);
+    }
+    sample_time = time;
+#if BUTTON_DEBOUNCE_FAST_ACCEPT
+    PCICR |= BUTTON_PIN_CHANGE_INTERRUPTS;
+#endif
+}
+
+
+uint8_t buttons_read(const uint8_t buttons) {
+    uint8_t presses;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        presses = latched_presses & buttons;
+        latched_presses &= ~buttons;
+    }
+    return presses | (debounced_buttons & buttons);
+}
+
+
+void buttons_report_sent(const uint32_t report_time) {
+    uint8_t sequence;
+    do {
+        sequence = edge_sequence;
+        memory_barrier();
+        for (uint8_t button = 0; button < BUTTON_COUNT; ++button) {
+            report_edges.press_age_us[button] = report_time - press_time[button];
+            report_edges.release_age_us[button] = report_time - release_time[button];
+        }
+        memory_barrier();
+    } while (sequence != edge_sequence);
+}
+
+
+uint32_t buttons_get_sample_time() {
+    uint32_t time;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        time = sample_time;
+    }
+    return time;
+}
+
+
+void buttons_get_press_counts(uint8_t counts[BUTTON_COUNT]) {
+    // Single bytes are read atomically, so the counters can be copied with interrupts enabled.
+    for (uint8_t button = 0; button < BUTTON_COUNT; ++button) {
+        counts[button] = press_counts[button];
+    }
+}
+
+
+void buttons_get_edges(struct button_edges_t *edges) {
+    *edges = report_edges;
+}
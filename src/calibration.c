@@ -0,0 +1,338 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include <avr/eeprom.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "usbdrv.h"
+
+#include "axis_table.h"
+#include "calibration.h"
+#include "hwinit.h"
+#include "joystick.h"
+#include "joystick_config.h"
+
+/**
+ * Changed whenever the layout of struct calibration_storage_t changes. An erased EEPROM reads 0xFF.
+ * The layout depends on the number of axis, so the version does as well.
+ */
+#define CALIBRATION_STORAGE_VERSION JOYSTICK_COUNT
+
+/**
+ * The smallest range between center and minimum or maximum, excluding the deadzone.
+ * Keeps the scale factors within 16 bits.
+ */
+#define CALIBRATION_MINIMUM_SPAN 8
+
+struct calibration_storage_t {
+    uint8_t version;
+    struct axis_calibration_t axis[AXIS_COUNT];
+};
+
+static struct calibration_storage_t EEMEM calibration_eeprom;
+
+/**
+ * The calibration of all axis, as set by the user. Only accessed outside of interrupts.
+ */
+static struct calibration_storage_t calibration;
+
+/**
+ * The calibration as stored in the EEPROM, or being written to it.
+ */
+static struct calibration_storage_t saved_calibration;
+
+/**
+ * Precomputed form of a calibration, which can be applied using multiplications only.
+ * The scale factors use 8 fractional bits.
+ */
+struct calibration_mapping_t {
+    int16_t center;
+    uint8_t deadzone;
+    uint16_t lower_scale;
+    uint16_t upper_scale;
+};
+
+/* The mappings are used by the ADC interrupt. New mappings are computed outside of the interrupt and placed in
+ * pending_mapping. The interrupt takes them over with the next measurement of the axis and clears the axis’ bit in
+ * pending_mapping_mask. That way, no interrupt is ever blocked while a mapping is copied.
+ */
+static struct calibration_mapping_t mapping[AXIS_COUNT];
+static struct calibration_mapping_t pending_mapping[AXIS_COUNT];
+static volatile uint8_t pending_mapping_mask;
+
+/**
+ * Index of the next EEPROM byte to compare and write, or sizeof(saved_calibration) if nothing is to be written.
+ */
+static uint8_t eeprom_write_index = sizeof(saved_calibration);
+
+
+static uint16_t compute_scale(const int16_t span) {
+    // Stretch the span to the full half axis range, rounded to the nearest scale factor.
+    const int16_t limited_span = span < CALIBRATION_MINIMUM_SPAN ? CALIBRATION_MINIMUM_SPAN : span;
+    return (((uint32_t) AXIS_POSITION_MAX << 8) + limited_span / 2) / limited_span;
+}
+
+
+static inline int16_t limit_position(const int16_t position) {
+    if (position < AXIS_POSITION_MIN) {
+        return AXIS_POSITION_MIN;
+    } else if (position > AXIS_POSITION_MAX) {
+        return AXIS_POSITION_MAX;
+    }
+    return position;
+}
+
+
+/**
+ * Limits minimum, center and maximum of the given calibration to the axis position range. Together with the 8 bit
+ * deadzone, the differences computed from them and from measured positions then always fit into an int16_t.
+ */
+static void limit_calibration(struct axis_calibration_t *axis_calibration) {
+    axis_calibration->minimum = limit_position(axis_calibration->minimum);
+    axis_calibration->center = limit_position(axis_calibration->center);
+    axis_calibration->maximum = limit_position(axis_calibration->maximum);
+}
+
+
+static void compute_mapping(const struct axis_calibration_t *axis_calibration, struct calibration_mapping_t *result) {
+    /* The fields are set one by one, so they may be out of order meanwhile. Treat a minimum above or a maximum below
+     * the center as the center, so that the scale factors are never computed from a negative span.
+     */
+    const int16_t center = axis_calibration->center;
+    const int16_t minimum = axis_calibration->minimum > center ? center : axis_calibration->minimum;
+    const int16_t maximum = axis_calibration->maximum < center ? center : axis_calibration->maximum;
+    result->center = center;
+    result->deadzone = axis_calibration->deadzone;
+    result->lower_scale = compute_scale(center - axis_calibration->deadzone - minimum);
+    result->upper_scale = compute_scale(maximum - axis_calibration->deadzone - center);
+}
+
+
+void calibration_load() {
+    eeprom_read_block(&saved_calibration, &calibration_eeprom, sizeof(saved_calibration));
+    calibration = saved_calibration;
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+        if (calibration.version != CALIBRATION_STORAGE_VERSION) {
+#if AUTO_CALIBRATION
+            // Start with a narrow range, which the auto-calibration widens to the actual axis range.
+            calibration.axis[axis].minimum = -AUTO_CALIBRATION_INITIAL_SPAN;
+            calibration.axis[axis].maximum = AUTO_CALIBRATION_INITIAL_SPAN;
+#else
+            calibration.axis[axis].minimum = AXIS_POSITION_MIN;
+            calibration.axis[axis].maximum = AXIS_POSITION_MAX;
+#endif
+            calibration.axis[axis].center = 0;
+            calibration.axis[axis].deadzone = 0;
+        }
+        // The EEPROM content is not trusted, as it may be corrupted.
+        limit_calibration(&calibration.axis[axis]);
+        compute_mapping(&calibration.axis[axis], &mapping[axis]);
+    }
+    calibration.version = CALIBRATION_STORAGE_VERSION;
+    pending_mapping_mask = 0;
+}
+
+
+int16_t calibration_apply(const uint8_t axis, const int16_t position) {
+    const uint8_t axis_bit = _BV(axis);
+    if (pending_mapping_mask & axis_bit) {
+        mapping[axis] = pending_mapping[axis];
+        pending_mapping_mask &= ~axis_bit;
+    }
+    const struct calibration_mapping_t *axis_mapping = &mapping[axis];
+    const int16_t offset = position - axis_mapping->center;
+    uint32_t magnitude;
+    // Both multiplications are single 16 × 16 bit hardware multiplications.
+    if (offset > axis_mapping->deadzone) {
+        magnitude = ((uint32_t) (uint16_t) (offset - axis_mapping->deadzone) * axis_mapping->upper_scale) >> 8;
+        return magnitude > AXIS_POSITION_MAX ? AXIS_POSITION_MAX : magnitude;
+    } else if (offset < -axis_mapping->deadzone) {
+        magnitude = ((uint32_t) (uint16_t) (-offset - axis_mapping->deadzone) * axis_mapping->lower_scale) >> 8;
+        return magnitude > AXIS_POSITION_MAX ? -AXIS_POSITION_MAX : -(int16_t) magnitude;
+    }
+    return 0;
+}
+
+
+uint16_t calibration_scale_distance(const uint8_t axis, const int16_t position, const uint16_t distance) {
+    const struct calibration_mapping_t *axis_mapping = &mapping[axis];
+    const uint16_t scale = position > axis_mapping->center ? axis_mapping->upper_scale : axis_mapping->lower_scale;
+    const uint32_t scaled_distance = ((uint32_t) distance * scale + 255) >> 8;
+    return scaled_distance > UINT16_MAX ? UINT16_MAX : scaled_distance;
+}
+
+
+/**
+ * Hands the current calibration of the given axis over to the ADC interrupt.
+ */
+static void update_mapping(const uint8_t axis) {
+    // Wait until the interrupt took over the previous mapping of this axis.
+    const uint8_t axis_bit = _BV(axis);
+    while (pending_mapping_mask & axis_bit) {
+    }
+    compute_mapping(&calibration.axis[axis], &pending_mapping[axis]);
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        pending_mapping_mask |= axis_bit;
+    }
+}
+
+
+void calibration_get(const uint8_t axis, struct axis_calibration_t *axis_calibration) {
+    *axis_calibration = calibration.axis[axis & (AXIS_COUNT - 1)];
+}
+
+
+void calibration_set_field(const uint8_t axis, const uint8_t field, const int16_t value) {
+    /* The sampling engine only applies the calibration to analog axis, so the mapping of a discrete axis would never
+     * be taken over, and the next update_mapping() would wait forever.
+     */
+    if (joystick_get_axis_mode(axis) != AXIS_MODE_ANALOG) {
+        return;
+    }
+    struct axis_calibration_t *axis_calibration = &calibration.axis[axis & (AXIS_COUNT - 1)];
+    switch (field) {
+        case CALIBRATION_FIELD_MINIMUM:
+            axis_calibration->minimum = value;
+            break;
+        case CALIBRATION_FIELD_CENTER:
+            axis_calibration->center = value;
+            break;
+        case CALIBRATION_FIELD_MAXIMUM:
+            axis_calibration->maximum = value;
+            break;
+        case CALIBRATION_FIELD_DEADZONE:
+            axis_calibration->deadzone = value < 0 ? 0 : value > UINT8_MAX ? UINT8_MAX : value;
+            break;
+        default:
+            return;
+    }
+    // The value comes from the host, so limit it to the axis position range.
+    limit_calibration(axis_calibration);
+    update_mapping(axis & (AXIS_COUNT - 1));
+#if AUTO_CALIBRATION
+    // A calibration set by the user replaces the learned one.
+    joystick_set_learned_extent(axis, axis_calibration);
+#endif
+}
+
+
+void calibration_save() {
+    saved_calibration = calibration;
+    eeprom_write_index = 0;
+}
+
+
+#if AUTO_CALIBRATION
+static inline uint8_t differs_by_threshold(const int16_t value, const int16_t saved_value) {
+    return value - saved_value >= AUTO_CALIBRATION_SAVE_THRESHOLD
+        || saved_value - value >= AUTO_CALIBRATION_SAVE_THRESHOLD;
+}
+
+
+/**
+ * Takes over the axis extents learned by the sampling engine into the calibration and stores the calibration,
+ * once it changed considerably and the axis stopped widening their ranges.
+ */
+static void auto_calibrate() {
+    uint8_t save_required = 0;
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+        struct axis_calibration_t *axis_calibration = &calibration.axis[axis];
+        if (!(pending_mapping_mask & _BV(axis))) {
+            // Only update an axis, if the interrupt took over its previous mapping, so that this never waits.
+            struct axis_calibration_t learned;
+            joystick_get_learned_extent(axis, &learned);
+            if (learned.minimum != axis_calibration->minimum || learned.center != axis_calibration->center
+                    || learned.maximum != axis_calibration->maximum) {
+                axis_calibration->minimum = learned.minimum;
+                axis_calibration->center = learned.center;
+                axis_calibration->maximum = learned.maximum;
+                update_mapping(axis);
+            }
+        }
+        const struct axis_calibration_t *saved_axis_calibration = &saved_calibration.axis[axis];
+        save_required |= differs_by_threshold(axis_calibration->minimum, saved_axis_calibration->minimum)
+            | differs_by_threshold(axis_calibration->center, saved_axis_calibration->center)
+            | differs_by_threshold(axis_calibration->maximum, saved_axis_calibration->maximum);
+    }
+    if ((save_required || saved_calibration.version != CALIBRATION_STORAGE_VERSION)
+            && joystick_frames_since_extent_change() >= AUTO_CALIBRATION_SAVE_DELAY_FRAMES) {
+        calibration_save();
+    }
+}
+#endif
+
+
+uint8_t calibration_write_pending() {
+    return eeprom_write_index < sizeof(saved_calibration);
+}
+
+
+/**
+ * Returns 1, if V-USB is in the middle of a control transfer: a received SETUP or OUT packet waits for usbPoll(),
+ * or data or a handshake waits for the next IN token.
+ */
+static inline uint8_t control_transfer_pending() {
+    // Internal state of V-USB, which usbdrv.h does not declare in this configuration.
+    extern volatile schar usbRxLen;
+    extern volatile uchar usbTxLen;
+    return usbRxLen != 0 || usbTxLen != USBPID_NAK;
+}
+
+
+void calibration_task(const uint8_t report_fetched) {
+    if (eeprom_write_index >= sizeof(saved_calibration)) {
+#if AUTO_CALIBRATION
+        auto_calibrate();
+#endif
+        return;
+    }
+    uint8_t *eeprom_address = (uint8_t *) &calibration_eeprom + eeprom_write_index;
+    const uint8_t value = ((const uint8_t *) &saved_calibration)[eeprom_write_index];
+    if (eeprom_read_byte(eeprom_address) == value) {
+        // Unchanged bytes are skipped, to not wear out the EEPROM.
+        ++eeprom_write_index;
+        return;
+    }
+    /* Datasheet: 29.6. Calibrated Internal RC Oscillator, page 45:
+     * “Note that this oscillator is used to time EEPROM and Flash write accesses, and these write times will be
+     * affected accordingly. If the EEPROM or Flash are written, do not calibrate to more than 8.8MHz.
+     * Otherwise, the EEPROM or Flash write may fail.”
+     * 
+     * So restore the factory calibration for the duration of the write. USB communication is impossible meanwhile,
+     * so the USB interrupt is disabled for approximately 3.4 ms. Any token sent by the host in that time gets no
+     * answer, which the host counts as a transaction error. A control transfer hit by this may fail, and repeated
+     * failures can make the host reset or disable the device.
+     * 
+     * To make this unlikely, a byte is only written right after the host fetched an interrupt report, so that the
+     * next interrupt poll is almost a full poll interval (at least 10 ms for a low speed device) away, and only if
+     * no control transfer is in progress. A SETUP packet starting a new control transfer during the write is still
+     * missed, so the calibration should not be saved while the host configures the device.
+     */
+    if (!report_fetched || control_transfer_pending()) {
+        return;
+    }
+    ++eeprom_write_index;
+    USB_INTR_ENABLE &= ~_BV(USB_INTR_ENABLE_BIT);
+    OSCCAL = factory_oscillator_calibration;
+    eeprom_write_byte(eeprom_address, value);
+    eeprom_busy_wait();
+    OSCCAL = DEVICE_OSCILLATOR_CALIBRATION;
+    USB_INTR_PENDING = _BV(USB_INTR_PENDING_BIT);
+    USB_INTR_ENABLE |= _BV(USB_INTR_ENABLE_BIT);
+}
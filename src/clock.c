@@ -0,0 +1,136 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "buttons.h"
+#include "clock.h"
+#include "usbdrv.h"
+
+/* V-USB requires that interrupts are never disabled for more than about 25 cycles, so the clock only keeps an
+ * 8 bit tick counter consistent with Timer0 while interrupts are disabled. It is extended to 32 bits outside of
+ * the critical section, using clock_ticks as base.
+ * 
+ * clock_tick_counter is the number of completed Timer0 periods modulo 256. clock_ticks is the full number of
+ * completed periods at the latest tick interrupt, so its lower 8 bits equal clock_tick_counter at that time.
+ * It is only written by the tick interrupt, and always copied as a whole with interrupts disabled.
+ */
+static uint8_t clock_tick_counter;
+static uint32_t clock_ticks;
+
+
+/**
+ * Counts a completed Timer0 period, if there is one, and returns the current Timer0 count and the tick counter
+ * belonging to it.
+ * 
+ * The period is counted using the Timer0 compare match A flag, which is never cleared by an interrupt routine.
+ * That way, the tick counter and the timer count are always consistent, even if called from an interrupt that
+ * interrupted the Timer0 interrupt. Clearing the flag also arms the ADC auto trigger for the next period.
+ * Interrupts are only disabled for the two timer reads, the flag handling and the 8 bit increment.
+ */
+static inline uint8_t clock_update(uint8_t *tick_counter) {
+    uint8_t count;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        count = TCNT0;
+        if (TIFR0 & _BV(OCF0A)) {
+            // Datasheet: 19.9.8. TC0 Interrupt Flag Register: “OCF0A is cleared by writing a logic one to the flag.”
+            TIFR0 = _BV(OCF0A);
+            ++clock_tick_counter;
+            // The timer might have just started a new period when reading the count.
+            count = TCNT0;
+        }
+        *tick_counter = clock_tick_counter;
+    }
+    return count;
+}
+
+
+static inline uint32_t atomic_read(const uint32_t *value) {
+    uint32_t result;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        result = *value;
+    }
+    return result;
+}
+
+
+static inline void atomic_write(uint32_t *value, const uint32_t new_value) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *value = new_value;
+    }
+}
+
+
+/**
+ * Extends an 8 bit counter to 32 bits, given a 32 bit base whose lower 8 bits held the counter value at some point.
+ * The base may lag behind or run ahead of the counter by up to 127 counts.
+ */
+static inline uint32_t extend_counter(const uint32_t base, const uint8_t counter) {
+    return base + (int8_t) (uint8_t) (counter - (uint8_t) base);
+}
+
+
+#if SOF_TIMEBASE
+/**
+ * Number of USB frames at the latest tick interrupt. Its lower 8 bits equal the 8 bit frame counter of the USB
+ * driver at that time. Like clock_ticks, it is only written by the tick interrupt and copied as a whole.
+ */
+static uint32_t usb_frames;
+
+
+uint32_t clock_usb_frames() {
+    // Reading the 8 bit counter of the USB driver is atomic, so only the base copy disables interrupts.
+    const uint8_t counter = usbSofCount;
+    return extend_counter(atomic_read(&usb_frames), counter);
+}
+#endif
+
+
+uint32_t clock_micros() {
+    uint8_t tick_counter;
+    const uint8_t count = clock_update(&tick_counter);
+    // The tick interrupt updates clock_ticks at least every tick, so it is never more than 127 ticks away.
+    const uint32_t ticks = extend_counter(atomic_read(&clock_ticks), tick_counter);
+    return ticks * CLOCK_TICK_US + count * CLOCK_COUNT_US;
+}
+
+
+ISR(TIMER0_COMPB_vect, ISR_NOBLOCK) {
+    /* Called once per clock tick, half way through the Timer0 period. This makes sure that every period is
+     * counted, even if clock_micros() is not called, and moves the base of the 32 bit tick count along.
+     * Runs with interrupts enabled, to not delay the USB interrupt.
+     */
+    uint8_t tick_counter;
+    clock_update(&tick_counter);
+    atomic_write(&clock_ticks, extend_counter(atomic_read(&clock_ticks), tick_counter));
+#if SOF_TIMEBASE
+    // A tick is at most 1 ms long, so the base never lags behind the frame counter by more than a few frames.
+    atomic_write(&usb_frames, clock_usb_frames());
+#endif
+#if CLOCK_TICKS_PER_DEBOUNCE_TICK > 1
+    // Short clock ticks are divided down to the debounce tick.
+    static uint8_t ticks_until_debounce = CLOCK_TICKS_PER_DEBOUNCE_TICK;
+    if (--ticks_until_debounce) {
+        return;
+    }
+    ticks_until_debounce = CLOCK_TICKS_PER_DEBOUNCE_TICK;
+#endif
+    buttons_debounce_tick();
+}
@@ -0,0 +1,79 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include "filter.h"
+#include "joystick_config.h"
+
+/* The medians are computed by partial sorting networks, so each takes a fixed number of comparisons,
+ * regardless of the values.
+ * See: N. Devillard, “Fast median search: an ANSI C implementation”, 1998.
+ */
+
+/**
+ * Orders a and b ascending.
+ */
+#define SORT_PAIR(a, b) do { if ((a) > (b)) { const uint16_t swap = (a); (a) = (b); (b) = swap; } } while (0)
+
+
+uint16_t median3(const uint16_t values[3]) {
+    uint16_t v0 = values[0], v1 = values[1], v2 = values[2];
+    SORT_PAIR(v0, v1);
+    SORT_PAIR(v1, v2);
+    SORT_PAIR(v0, v1);
+    return v1;
+}
+
+
+uint16_t median5(const uint16_t values[5]) {
+    uint16_t v0 = values[0], v1 = values[1], v2 = values[2], v3 = values[3], v4 = values[4];
+    SORT_PAIR(v0, v1);
+    SORT_PAIR(v3, v4);
+    SORT_PAIR(v0, v3);
+    SORT_PAIR(v1, v4);
+    SORT_PAIR(v1, v2);
+    SORT_PAIR(v2, v3);
+    SORT_PAIR(v1, v2);
+    return v2;
+}
+
+
+int16_t adaptive_filter(
+        struct adaptive_filter_t *filter, const struct adaptive_filter_parameters_t *parameters, const int16_t position) {
+    const int16_t value = position << 4;
+    /* The difference of two 12.4 values needs 17 bits.
+     * Estimate the speed with a fixed smoothing factor, so that noise does not open the filter.
+     */
+    const int32_t change = (int32_t) value - filter->value;
+    int32_t speed = filter->speed + ((change - filter->speed) >> ADAPTIVE_FILTER_SPEED_SMOOTHING_BITS);
+    if (speed > INT16_MAX) {
+        speed = INT16_MAX;
+    } else if (speed < -INT16_MAX) {
+        speed = -INT16_MAX;
+    }
+    filter->speed = speed;
+
+    // Raise the smoothing factor with the speed.
+    const uint16_t absolute_speed = speed < 0 ? -speed : speed;
+    uint32_t alpha = parameters->min_alpha + (((uint32_t) parameters->beta * absolute_speed) >> 8);
+    if (alpha > 256) {
+        alpha = 256;
+    }
+    filter->value += (int16_t) ((change * (int16_t) alpha) >> 8);
+    // Round to the nearest position.
+    return (filter->value + 8) >> 4;
+}
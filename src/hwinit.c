@@ -17,7 +17,16 @@
 #include <avr/io.h>
  #include <avr/wdt.h>
  
+#include "calibration.h"
+#include "clock.h"
 #include "hwinit.h"
+#include "joystick_config.h"
+
+/**
+ * The factory calibration of the internal oscillator, which is the value of OSCCAL after reset.
+ * Used to time EEPROM writes.
+ */
+uint8_t factory_oscillator_calibration;
 
 
 void hwinit() {
@@ -25,8 +34,20 @@ void hwinit() {
     wdt_enable(WDTO_1S);
     wdt_reset();
 
+#if FILTER_CYCLE_MEASUREMENT
+    /* Disable some unused components: USART, SPI.
+     * Run the 16 bit TIMER1 with the CPU clock (no prescaling) to count CPU cycles.
+     * Datasheet: 20.14.2. TC1 Control Register B, page 173.
+     */
+    PRR |=  _BV(PRUSART0) | _BV(PRSPI);
+    TCCR1B = _BV(CS10);
+#elif AXIS_MEASUREMENT == AXIS_MEASUREMENT_RC_TIMING
+    // Disable some unused components: USART, SPI. The RC timing measurement engine configures TIMER1.
+    PRR |=  _BV(PRUSART0) | _BV(PRSPI);
+#else
     // Disable some unused components: USART, SPI, 16 bit TIMER1
     PRR |=  _BV(PRUSART0) | _BV(PRSPI) | _BV(PRTIM1);
+#endif
     
     /* Set the oscillator to 12.8 MHz, which is the only available frequency
      * usable with both V-USB and the ATmega328P’s internal oscillator.
@@ -36,7 +57,8 @@ void hwinit() {
      * TODO: Read this value from the EEPROM, instead of hardcoding it here, as it
      * has to be configured individually per device.
      */
-    OSCCAL = 234;
+    factory_oscillator_calibration = OSCCAL;
+    OSCCAL = DEVICE_OSCILLATOR_CALIBRATION;
     
     /* Enable the ADC. See Datasheet: Chapter 28.2,  page 305:
      * “The Power Reduction ADC bit in the Power Reduction Register (PRR.PRADC)
@@ -48,20 +70,25 @@ void hwinit() {
      * Enable the ADC circuitry:
      * - Enable the circuitry (ADEN)
      * - Enable the ADC Conversion Complete Interrupt (ADIE)
-     * - Set the ADC prescaler to 128. Sets the ADC frequency to F_CPU/128 = 12.8MHz/128 = 100 kHz,
-     *   which is in the range for high precision (50-200Mhz).
+     * - Set the ADC prescaler to 64. Sets the ADC frequency to F_CPU/64 = 12.8MHz/64 = 200 kHz,
+     *   which is the upper limit for 10 bit ADC output.
      * 
-     * TODO: If this is too slow, use a divider value of 64 to reach 200 kHz,
-     *       which is denoted as the upper limit for 10 bit ADC output.
+     * The sampling engine sets the prescaler for each conversion according to the ADC clock profile of the
+     * measured axis, so this is only the initial value.
      * 
      * Datasheet: 28.4. Prescaling and Conversion Timing, page 308:
      * “By default, the successive approximation circuitry requires an input clock frequency between 50kHz and
      * 200kHz to get maximum resolution. If a lower resolution than 10 bits is needed, the input clock frequency
      * to the ADC can be higher than 200kHz to get a higher sample rate.”
+     * 
+     * The RC timing measurement engine keeps the ADC switched off, as it uses the ADC multiplexer for the
+     * analog comparator.
      */
-    ADCSRA |= _BV(ADPS0) | _BV(ADPS1) | _BV(ADPS2)
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+    ADCSRA |= _BV(ADPS1) | _BV(ADPS2)
             | _BV(ADEN)
             | _BV(ADIE);
+#endif
             
     /* Datasheet: 28.9.1. ADC Multiplexer Selection Register, page 317:
      * - Use channel PORTC4 (0x04) to read the analog axis data.
@@ -87,6 +114,39 @@ void hwinit() {
      */
     DIDR0 |= _BV(ADC4D);
     
+#if BUTTON_DEBOUNCE_FAST_ACCEPT
+    /* Datasheet: 17.2.4. Pin Change Interrupt Control Register:
+     * “When the PCIE1 bit is set and the I-bit in the Status Register (SREG) is set, pin change interrupt 1 is
+     *  enabled. Any change on any enabled PCINT[14:8] pin will cause an interrupt.”
+     * 
+     * Datasheet: 17.2.7. Pin Change Mask Register 1:
+     * Enable the pin change interrupt for the four buttons on Port C 0-3 (PCINT8-11), so that the first edge
+     * of a button press is taken without waiting for the debouncer.
+     */
+    PCMSK1 |= _BV(PCINT8) | _BV(PCINT9) | _BV(PCINT10) | _BV(PCINT11);
+    PCIFR = _BV(PCIF1);
+    PCICR |= _BV(PCIE1);
+#if BUTTON_COUNT == 8
+    // Datasheet: 17.2.6. Pin Change Mask Register 2: Buttons 5-8 on Port D 1, 5, 6 and 7 (PCINT17, PCINT21-23).
+    PCMSK2 |= _BV(PCINT17) | _BV(PCINT21) | _BV(PCINT22) | _BV(PCINT23);
+    PCIFR = _BV(PCIF2);
+    PCICR |= _BV(PCIE2);
+#endif
+#endif
+    
+    /* Datasheet: 19.9. TC0 Register Description:
+     * Timer0 provides the clock and the button debouncer tick. Run it in Clear Timer on Compare Match (CTC) mode
+     * (WGM01), which restarts the count after OCR0A, with the CPU clock divided by 64 (CS01, CS00).
+     * That way, a period takes exactly CLOCK_TICK_US. The compare match A flag marks each completed period.
+     * The compare match B interrupt (OCIE0B) runs the clock tick half way through each period.
+     */
+    TCCR0A = _BV(WGM01);
+    OCR0A = CLOCK_TICK_COUNTS - 1;
+    OCR0B = CLOCK_TICK_COUNTS / 2;
+    TIFR0 = _BV(OCF0A) | _BV(OCF0B);
+    TIMSK0 = _BV(OCIE0B);
+    TCCR0B = _BV(CS01) | _BV(CS00);
+    
     /* Configure Port B to control the resistor battery multiplexer and the axis selection multiplexer.
      * Each is driven by three bits of Port B. So configure these pins as outputs.
      */
@@ -99,16 +159,21 @@ void hwinit() {
      * 
      * Enable the pull-up for all unused pins.
      * 
+     * Port D 0, 1, 5, 6 and 7 are not used by USB and the debug output. In 8 button mode, Port D 1, 5, 6 and 7
+     * read buttons 5-8, which pull the pin low when pressed, so these need the pull-up as well.
+     * 
      * TODO: Fill this section when the circuitry is fully designed and
      * configure all unused pins as input with enabled pull-up resistors.
      */
-     // DDRD &= ~ (_BV(DDC1) |  _BV(DDC2) |  _BV(DDC3) |  _BV(DDC4) |  _BV(DDC5));
-     // PORTD |= _BV(PORTC1) |  _BV(PORTC2) |  _BV(PORTC3) |  _BV(PORTC4) |  _BV(PORTC5);
+     DDRD &= ~ (_BV(DDD0) | _BV(DDD1) | _BV(DDD5) | _BV(DDD6) | _BV(DDD7));
+     PORTD |= _BV(PORTD0) | _BV(PORTD1) | _BV(PORTD5) | _BV(PORTD6) | _BV(PORTD7);
      // The topmost two bits of port B are not used, as these pins may be used in the future to connect an external clock source,
      // if the internal 12.8MHz clock has proven to be inappropriate.
      DDRB &= ~ (_BV(DDB6) | _BV(DDB7));
      PORTB |= _BV(PORTB6) | _BV(PORTB7);
      PINB |= _BV(PINB6) | _BV(PINB7);
+     
+     calibration_load();
 }
 
 
@@ -0,0 +1,87 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef AXIS_TABLE_H_INCLUDED
+#define AXIS_TABLE_H_INCLUDED
+
+#include <stdint.h>
+
+#include "joystick_config.h"
+
+/* Converts a measurement of the axis voltage divider into a linear axis position.
+ * 
+ * The potentiometer with resistance R_axis is connected to Vcc, the selected resistor R_range to ground.
+ * The ADC measures the voltage between both, so an ADC code c relates to the potentiometer resistance as
+ * 
+ *     c / 1024 = R_range / (R_range + R_axis)   =>   R_axis = R_range * (1024 - c) / c
+ * 
+ * The potentiometer resistance is linear to the stick position, so it is scaled to the logical
+ * axis range -2047 to 2047 declared in the HID report descriptor.
+ * 
+ * Evaluating this needs a 32 bit division, which is far too slow to do for each sample.
+ * So the compiler evaluates the equation at build time for AXIS_TABLE_KNOTS equidistant ADC codes per range
+ * and the resulting table is interpolated linearly at run time.
+ * 
+ * The table is indexed with oversampled ADC codes, which carry AXIS_OVERSAMPLING_MAX_BITS additional
+ * fractional bits.
+ */
+
+#define AXIS_POSITION_MIN (-2047)
+#define AXIS_POSITION_MAX 2047
+
+/**
+ * The table contains a knot every AXIS_TABLE_STEP ADC codes, the last knot is at ADC code 1024.
+ */
+#define AXIS_TABLE_STEP_BITS 4
+#define AXIS_TABLE_STEP (1 << AXIS_TABLE_STEP_BITS)
+#define AXIS_TABLE_KNOTS (1024 / AXIS_TABLE_STEP + 1)
+
+/**
+ * Number of bits of an interpolation fraction between two knots, when indexing with an oversampled ADC code.
+ */
+#define AXIS_TABLE_FRACTION_BITS (AXIS_TABLE_STEP_BITS + AXIS_OVERSAMPLING_MAX_BITS)
+
+/**
+ * Resistance of the axis potentiometer in Ω for the given range resistor and ADC code,
+ * limited to the potentiometer’s total resistance.
+ */
+#define AXIS_RESISTANCE(range_resistor, adc_code) \
+    ((adc_code) == 0 || (int32_t) (range_resistor) * (1024 - (adc_code)) / (adc_code) > AXIS_POTENTIOMETER_OHM \
+        ? (int32_t) AXIS_POTENTIOMETER_OHM \
+        : (int32_t) (range_resistor) * (1024 - (adc_code)) / (adc_code))
+
+/**
+ * Axis position for the given range resistor and ADC code.
+ */
+#define AXIS_POSITION(range_resistor, adc_code) \
+    ((int16_t) (AXIS_RESISTANCE(range_resistor, adc_code) * (AXIS_POSITION_MAX - AXIS_POSITION_MIN) \
+        / AXIS_POTENTIOMETER_OHM + AXIS_POSITION_MIN))
+
+/**
+ * Converts an oversampled ADC code measured with the given range into the linear axis position.
+ * The code is given in units of 1/2^AXIS_OVERSAMPLING_MAX_BITS ADC steps.
+ * The result is monotonic across all ranges and lies within AXIS_POSITION_MIN and AXIS_POSITION_MAX.
+ */
+int16_t axis_position(const uint8_t range, const uint16_t oversampled_adc_value);
+
+/**
+ * Returns the change of the axis position caused by a single ADC code at the given oversampled ADC code,
+ * in 8.8 fixed point. This is the slope of the table between the surrounding knots.
+ */
+uint16_t axis_position_step(const uint8_t range, const uint16_t oversampled_adc_value);
+
+#endif // AXIS_TABLE_H_INCLUDED
@@ -0,0 +1,68 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef BUTTONS_H_INCLUDED
+#define BUTTONS_H_INCLUDED
+
+#include <stdint.h>
+
+#include "joystick_config.h"
+
+/**
+ * Times of the most recent debounced edges of each button, given as the time in µs between the edge and
+ * the creation of the latest report. Buttons without edges since startup report the time since startup.
+ */
+struct button_edges_t {
+    uint32_t press_age_us[BUTTON_COUNT];
+    uint32_t release_age_us[BUTTON_COUNT];
+};
+
+/**
+ * Returns the debounced state of the given buttons for the next report, one bit per button, set if pressed.
+ * A button counts as pressed, if it is currently held down or was pressed at any time since it was last read.
+ * That way, every press reaches the host, even if it is released before the next report is sent.
+ * Must only be called from the main loop, when building a report.
+ */
+uint8_t buttons_read(const uint8_t buttons);
+
+/**
+ * Copies the number of debounced presses of each button since startup. The counters wrap around.
+ */
+void buttons_get_press_counts(uint8_t press_counts[BUTTON_COUNT]);
+
+/**
+ * Copies the edge times of all buttons, relative to the latest sent report.
+ */
+void buttons_get_edges(struct button_edges_t *edges);
+
+/**
+ * Takes the edge times relative to a report sent at the given time, as given by clock_micros().
+ * Must only be called from the main loop.
+ */
+void buttons_report_sent(const uint32_t report_time);
+
+/**
+ * Returns the time the debounced button state was last updated, as given by clock_micros().
+ */
+uint32_t buttons_get_sample_time();
+
+/**
+ * Advances the debouncer by one clock tick. Called by the clock interrupt.
+ */
+void buttons_debounce_tick();
+
+#endif // BUTTONS_H_INCLUDED
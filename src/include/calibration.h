@@ -0,0 +1,95 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CALIBRATION_H_INCLUDED
+#define CALIBRATION_H_INCLUDED
+
+#include <stdint.h>
+
+#include "joystick_config.h"
+
+/**
+ * Calibration of an axis, given in axis positions as measured by the sampling engine.
+ * Positions within deadzone steps around the center are reported as centered. The remaining ranges between
+ * minimum and center and between center and maximum are each stretched to the full logical range.
+ */
+struct axis_calibration_t {
+    int16_t minimum;
+    int16_t center;
+    int16_t maximum;
+    uint8_t deadzone;
+};
+
+/**
+ * Field numbers of struct axis_calibration_t, used to set a single field using calibration_set_field().
+ */
+#define CALIBRATION_FIELD_MINIMUM 0
+#define CALIBRATION_FIELD_CENTER 1
+#define CALIBRATION_FIELD_MAXIMUM 2
+#define CALIBRATION_FIELD_DEADZONE 3
+
+/**
+ * Loads the calibration of all axis from the EEPROM. Axis without a stored calibration are not calibrated,
+ * i.e. the measured position is reported unchanged. Called by hwinit().
+ */
+void calibration_load();
+
+/**
+ * Maps the measured position of the given axis to the calibrated logical axis range of -2047 to 2047.
+ * Called by the sampling engine for each axis measurement. Does not divide, so it can be used in interrupts.
+ */
+int16_t calibration_apply(const uint8_t axis, const int16_t position);
+
+/**
+ * Scales a distance between measured positions of the given axis near the given measured position to calibrated
+ * position steps, rounded up. Called by the sampling engine after calibration_apply().
+ */
+uint16_t calibration_scale_distance(const uint8_t axis, const int16_t position, const uint16_t distance);
+
+/**
+ * Copies the current calibration of the given axis.
+ */
+void calibration_get(const uint8_t axis, struct axis_calibration_t *calibration);
+
+/**
+ * Sets a single field of the calibration of the given axis. The new calibration is used from the next axis
+ * measurement on, but not stored in the EEPROM until calibration_save() is called.
+ * Positions are limited to AXIS_POSITION_MIN to AXIS_POSITION_MAX, the deadzone to 0 to 255.
+ * Discrete axis are not calibrated, so requests for them are ignored.
+ * Must not be called from interrupts.
+ */
+void calibration_set_field(const uint8_t axis, const uint8_t field, const int16_t value);
+
+/**
+ * Requests storing the calibration of all axis in the EEPROM. The EEPROM is written in the background by
+ * calibration_task().
+ */
+void calibration_save();
+
+/**
+ * Returns 1, while calibration changes wait to be written to the EEPROM.
+ */
+uint8_t calibration_write_pending();
+
+/**
+ * Writes pending calibration changes to the EEPROM, at most one byte per call.
+ * Must be called regularly from the main loop. report_fetched is 1 if the host fetched an interrupt report since
+ * the previous call. Changed bytes are only written then, because the USB interrupt is disabled during the write.
+ */
+void calibration_task(const uint8_t report_fetched);
+
+#endif // CALIBRATION_H_INCLUDED
@@ -0,0 +1,69 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef CLOCK_H_INCLUDED
+#define CLOCK_H_INCLUDED
+
+#include <stdint.h>
+
+#include "joystick_config.h"
+
+/**
+ * Timer0 runs with the CPU clock divided by 64, so each timer count takes 5 µs at 12.8 MHz.
+ */
+#define CLOCK_COUNT_US (64000000UL / F_CPU)
+
+/**
+ * Length of a clock tick, i.e. a full Timer0 period, in µs. With ADC_AUTO_TRIGGER, each tick triggers an ADC
+ * conversion, so the tick is the ADC sample period.
+ */
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC && ADC_AUTO_TRIGGER
+#define CLOCK_TICK_US ADC_AUTO_TRIGGER_PERIOD_US
+#else
+#define CLOCK_TICK_US 1000
+#endif
+
+/**
+ * Length of a button debounce tick in µs. Button debouncing runs once every CLOCK_TICKS_PER_DEBOUNCE_TICK ticks.
+ */
+#define CLOCK_DEBOUNCE_TICK_US 1000
+#define CLOCK_TICKS_PER_DEBOUNCE_TICK ((CLOCK_DEBOUNCE_TICK_US + CLOCK_TICK_US / 2) / CLOCK_TICK_US)
+
+/**
+ * Number of Timer0 counts per clock tick. At most 256.
+ */
+#define CLOCK_TICK_COUNTS (CLOCK_TICK_US / CLOCK_COUNT_US)
+
+#if CLOCK_TICK_COUNTS > 256 || CLOCK_TICK_COUNTS * CLOCK_COUNT_US != CLOCK_TICK_US
+#error "The clock tick must be a multiple of CLOCK_COUNT_US and at most 256 Timer0 counts"
+#endif
+
+/**
+ * Returns the time since startup in µs, with a resolution of CLOCK_COUNT_US. Wraps around after about 71 minutes.
+ * Can be called from interrupts.
+ */
+uint32_t clock_micros();
+
+#if SOF_TIMEBASE
+/**
+ * Returns the number of USB frames since startup, counted from the keep-alive signals of the host. Each frame takes
+ * 1 ms of host time. The count stops while the bus is suspended. Can be called from interrupts.
+ */
+uint32_t clock_usb_frames();
+#endif
+
+#endif // CLOCK_H_INCLUDED
@@ -0,0 +1,63 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef FILTER_H_INCLUDED
+#define FILTER_H_INCLUDED
+
+#include <stdint.h>
+
+/**
+ * Returns the median of the 3 given values. Needs 3 comparisons.
+ */
+uint16_t median3(const uint16_t values[3]);
+
+/**
+ * Returns the median of the 5 given values. Needs 7 comparisons.
+ */
+uint16_t median5(const uint16_t values[5]);
+
+/**
+ * State of the adaptive low-pass filter of an axis. Both values use 12.4 fixed point.
+ * The speed is given in position steps per measurement.
+ */
+struct adaptive_filter_t {
+    int16_t value;
+    int16_t speed;
+};
+
+/**
+ * Parameters of the adaptive low-pass filter in 8.8 fixed point.
+ * The smoothing factor alpha is min_alpha + beta * |speed|, limited to 1.0 (256), which disables the smoothing.
+ * So a resting axis is smoothed strongly, while a moving axis follows the input with almost no lag.
+ */
+struct adaptive_filter_parameters_t {
+    uint16_t min_alpha;
+    uint8_t beta;
+};
+
+/**
+ * Filters the given axis position with a speed-dependent cutoff frequency, similar to the 1€ filter
+ * (G. Casiez, N. Roussel, D. Vogel: “1€ Filter: A Simple Speed-based Low-pass Filter for Noisy Input in
+ * Interactive Systems”, CHI 2012).
+ * The sampling interval is taken as constant, which turns the filter into a weighted moving average,
+ * whose smoothing factor rises linearly with the axis speed. This avoids all divisions.
+ * Returns the filtered position.
+ */
+int16_t adaptive_filter(
+    struct adaptive_filter_t *filter, const struct adaptive_filter_parameters_t *parameters, const int16_t position);
+
+#endif // FILTER_H_INCLUDED
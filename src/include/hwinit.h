@@ -17,10 +17,24 @@
 #ifndef HWINIT_H_INCLUDED
 #define HWINIT_H_INCLUDED
 
+#include <stdint.h>
+
+/**
+ * The OSCCAL value tuning the internal oscillator to 12.8 MHz. Empirically determined.
+ */
+#define DEVICE_OSCILLATOR_CALIBRATION 234
+
+/**
+ * The factory calibration of the internal oscillator, as loaded into OSCCAL at reset. Set by hwinit().
+ * The EEPROM must only be written while the oscillator runs with this calibration.
+ */
+extern uint8_t factory_oscillator_calibration;
+
 /**
  * Performs hardware initialisation:
  * - Sets the oscillator frequency
  * - Disable unneccessary hardware components
+ * - Loads the axis calibration from the EEPROM
  */
 
 void hwinit();
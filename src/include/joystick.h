@@ -19,48 +19,203 @@
 
 #include <stdint.h>
 
+#include "calibration.h"
+#include "joystick_config.h"
+
+#if HAT_SWITCH_AXIS && JOYSTICK_BUTTON_COUNT > 4
+#error "The hat switch can only be used with 4 buttons"
+#endif
+
 /**
- * Structure that stores joystick reads. 4 axis and (up to) 8 digital buttons
+ * Structure that stores the axis of a joystick, as published by the sampling engine.
+ * If enabled, it also stores the hat switch position.
  */
 struct joystick_read_t {
-    uint16_t axis[4];
+    int16_t axis[4];
+#if HAT_SWITCH_AXIS
+    uint8_t hat_switch;
+#endif
+};
+
+/**
+ * The HID report of a joystick: 4 axis with 12 bits each and (up to) 8 digital buttons in 7 bytes.
+ * If enabled, the hat switch uses the upper 4 bits of the button byte.
+ * With BUTTON_REPORT, the button byte is sent in the button report instead, so this is the axis report.
+ * With REPORT_IDS, the report starts with its HID report ID.
+ * Either way, the report fits into a single 8 byte interrupt packet.
+ */
+struct joystick_report_t {
+#if REPORT_IDS
+    uint8_t report_id;
+#endif
+    // Two axis in every three bytes, as 12 bit two's complement numbers, least significant bits first.
+    uint8_t axis[6];
+#if !BUTTON_REPORT
     uint8_t buttons;
+#endif
 };
 
 /**
- * Reads the joystick values and stores them in the global joystick_read_result variable.
+ * The button report of a joystick, holding the button byte including the hat switch.
  */
-void read_joystick();
+struct joystick_button_report_t {
+    uint8_t report_id;
+    uint8_t buttons;
+};
 
+/**
+ * Flags returned by read_joystick(), telling what changed since the latest sent report.
+ * REPORT_CHANGED_BUTTONS includes the hat switch. With BUTTON_REPORT, the flags tell which of the two reports has
+ * to be sent.
+ */
+#define REPORT_CHANGED_BUTTONS 1
+#define REPORT_CHANGED_AXIS 2
 
 /**
- * Calibrates the given axis and do an averaged analog read with 4 reads.
+ * Ages of the values in the latest report of a joystick, i.e. the time in µs between sampling each value and handing
+ * the report to the USB driver. The button age refers to the latest debouncer update.
  */
-uint16_t calibrate_and_read_axis(const uint8_t axis);
+struct report_ages_t {
+    uint32_t axis_age_us[4];
+    uint32_t buttons_age_us;
+};
 
 /**
- * Set the ADC input pin to read from.
- * Should be used to set the channel before reading a value with analog_read().
- * 
- * Allowed values are 0-7, of which 6 and 7 are inaccessible
- * on the hardware side for chips in PDIP-28 form factor.
- * (These two are only routed on 32 pin TQFP and 32 pin MLF chips.)
+ * Reads the values of the given joystick and stores them as report in the global joystick_read_result array, and
+ * with BUTTON_REPORT also as button report in the global joystick_button_report array.
+ * Must only be called from the main loop, which is the only user of these arrays.
+ * Returns the REPORT_CHANGED_* flags: A button or the hat switch changed, or an axis moved by more than its
+ * AXIS_n_REPORT_THRESHOLD, since the latest sent report of the joystick. 0, if nothing changed.
  */
-void joystick_set_analog_input_pin(const uint8_t channel);
+uint8_t read_joystick(const uint8_t joystick);
+
+/**
+ * Marks the report of the given joystick as sent, or its button report, if button_report is set.
+ * Without BUTTON_REPORT, the report includes the buttons. Must be called right after handing the report to the
+ * USB driver.
+ */
+void joystick_report_sent(const uint8_t joystick, const uint8_t button_report);
+
+/**
+ * Copies the ages of the values in the latest report of the given joystick.
+ */
+void joystick_get_report_ages(const uint8_t joystick, struct report_ages_t *ages);
+
+/**
+ * Report counters, telling whether the sampling engine keeps up with the reports. A report is stale, if no new frame
+ * was published since the previous report of the same joystick. reports counts the reports containing the axis,
+ * button reports are counted separately.
+ * The counters wrap around.
+ */
+struct report_statistics_t {
+    uint16_t reports;
+    uint16_t stale_reports;
+    uint16_t button_reports;
+};
+
+/**
+ * Copies the report counters.
+ */
+void joystick_get_report_statistics(struct report_statistics_t *statistics);
+
+
+/**
+ * Starts the background acquisition engine.
+ * The ADC interrupt continuously converts all axis, selects the proper measurement range for each
+ * and stores the oversampled results. Must be called once after hwinit(), interrupts have to be enabled
+ * for the sampling to run.
+ */
+void joystick_start_sampling();
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+/**
+ * Sets the ADC clock profile used to measure the given axis, one of the ADC_PROFILE_* values in joystick_config.h.
+ * The profile is used from the next measurement of the axis on. Invalid profiles are ignored.
+ */
+void joystick_set_adc_profile(const uint8_t axis, const uint8_t adc_profile);
+#endif
 
 /**
- * Reads the analog value on the pin selected by joystick_set_analog_input_pin().
- * Converts the analog value to a value with 10 bit precision using the ADC hardware
- * and returns it in the lowest 10 bits of the returned uint16_t value.
+ * Returns the axis to measure next, according to the frame schedule. Sets frame_end, if the measurement is the last
+ * one of the frame. Used by measurement engines other than the ADC engine, from their interrupt.
  */
-uint16_t analog_read();
+uint8_t joystick_schedule_next_axis(uint8_t *frame_end);
 
 /**
- * Reads the analog value on the pin selected by joystick_set_analog_input_pin() 3 additional times
- * and averages the result by computing the arithmetic mean of all reads.
- * Converts the analog value to a value with 10 bit precision using the ADC hardware
- * and returns it in the lowest 10 bits of the returned uint16_t value.
+ * Processes an axis measurement given as axis position in the range of -2047 to 2047 and publishes the frame,
+ * if frame_end is set. position_step is the change of the position caused by a single unit of the measurement,
+ * an ADC code or a Timer1 count, in 8.8 fixed point. It scales the report threshold of the axis.
+ * Used by the measurement engines, from their interrupt.
  */
-uint16_t analog_read4(uint16_t result);
+void joystick_process_axis_measurement(const uint8_t axis, int16_t position, const uint16_t position_step,
+        const uint8_t frame_end);
+
+/**
+ * Returns the mode of the given axis, one of the AXIS_MODE_* values in joystick_config.h.
+ */
+uint8_t joystick_get_axis_mode(const uint8_t axis);
+
+/**
+ * Sets the parameters of the adaptive low-pass filter of the given axis. See adaptive_filter() in filter.h.
+ * A min_alpha of 256 disables the filter.
+ */
+void joystick_set_filter_parameters(const uint8_t axis, const uint16_t min_alpha, const uint8_t beta);
+
+#if FILTER_CYCLE_MEASUREMENT
+/**
+ * Runtime measurement of the adaptive filter in CPU cycles.
+ */
+struct filter_cycles_t {
+    uint16_t worst_case;
+    uint16_t budget_overruns;
+};
+
+/**
+ * Copies the runtime measurement of the adaptive filter.
+ */
+void joystick_get_filter_cycles(struct filter_cycles_t *cycles);
+#endif
+
+#if AUTO_CALIBRATION
+/**
+ * Copies the axis extent learned by the auto-calibration into the minimum, center and maximum fields of the given
+ * calibration. The deadzone is not written.
+ */
+void joystick_get_learned_extent(const uint8_t axis, struct axis_calibration_t *extent);
+
+/**
+ * Restarts learning the axis extent from the minimum, center and maximum of the given calibration.
+ */
+void joystick_set_learned_extent(const uint8_t axis, const struct axis_calibration_t *extent);
+
+/**
+ * Returns the number of published frames since an axis last widened its learned extent. Saturates at 65535.
+ */
+uint16_t joystick_frames_since_extent_change();
+#endif
+
+/**
+ * Copies the axis of the given joystick from the most recently published frame into the given structure.
+ * The copy is always consistent, i.e. all axis values stem from the same sampling pass,
+ * without disabling interrupts.
+ * Returns the sequence number of the copied frame, which is incremented for every published frame.
+ */
+uint8_t joystick_get_frame(const uint8_t joystick, struct joystick_read_t *frame);
+
+/**
+ * Returns the most recent oversampled axis position of the given axis (0 to AXIS_COUNT - 1), as measured by the background
+ * acquisition engine. Does not block. The position is independent of the used measurement range
+ * and lies within the logical range of -2047 to 2047.
+ */
+int16_t calibrate_and_read_axis(const uint8_t axis);
+
+/**
+ * Set the ADC input pin to read from.
+ * 
+ * Allowed values are 0-7, of which 6 and 7 are inaccessible
+ * on the hardware side for chips in PDIP-28 form factor.
+ * (These two are only routed on 32 pin TQFP and 32 pin MLF chips.)
+ */
+void joystick_set_analog_input_pin(const uint8_t channel);
 
 #endif // ANALOG_READ_H_INCLUDED
@@ -0,0 +1,310 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef JOYSTICK_CONFIG_H_INCLUDED
+#define JOYSTICK_CONFIG_H_INCLUDED
+
+/* Compile-time configuration of the joystick hardware and the sampling engine.
+ * This header only contains preprocessor definitions, so it can be included from anywhere.
+ */
+
+/**
+ * Total resistance of the axis potentiometers in Ω. The gameport standard uses 100kΩ potentiometers.
+ */
+#define AXIS_POTENTIOMETER_OHM 100000
+
+/**
+ * Resistors in the resistor battery in Ω, ordered by ascending value.
+ * Each forms a voltage divider with the axis potentiometer, when selected by the resistor battery multiplexer.
+ * These values have to match the resistors on the board.
+ */
+#define AXIS_RANGE_0_RESISTOR_OHM 1000
+#define AXIS_RANGE_1_RESISTOR_OHM 4700
+#define AXIS_RANGE_2_RESISTOR_OHM 22000
+#define AXIS_RANGE_3_RESISTOR_OHM 100000
+
+/**
+ * Settle times in µs of the external axis multiplexer and the resistor battery multiplexer.
+ * The multiplexers are switched while the previous conversion is still running. If a stage needs more time to settle
+ * than the remaining conversion time, additional conversions are inserted and discarded after switching it.
+ */
+#define AXIS_MULTIPLEXER_SETTLE_US 20
+#define RANGE_MULTIPLEXER_SETTLE_US 20
+
+/**
+ * Axis measurement engines:
+ * - AXIS_MEASUREMENT_ADC: Measures the voltage divider formed by the axis potentiometer and a resistor of the resistor
+ *   battery with the ADC. The resistor is switched to cover the whole axis range.
+ * - AXIS_MEASUREMENT_RC_TIMING: Times the charge of a capacitor through the axis potentiometer, like the original
+ *   gameport does. A capacitor of RC_TIMING_CAPACITOR_NF connects the axis input (ADC4) to ground, and the resistor
+ *   battery multiplexer is switched to RC_TIMING_RANGE_CHANNEL, which has to be unconnected. The analog comparator
+ *   compares the capacitor voltage with the internal bandgap reference and stops Timer1 via input capture, which
+ *   covers the whole axis range with a single measurement.
+ *   The capacitor is discharged for RC_TIMING_DISCHARGE_US before each measurement, by driving the axis input low.
+ *   A resistor of RC_TIMING_SERIES_RESISTOR_OHM is required between the axis multiplexer and the axis input, like
+ *   the 2.2 kΩ resistors of the original gameport cards. Otherwise, a potentiometer near its minimum resistance
+ *   connects the low pin almost directly to Vcc, which exceeds the current rating of the pin. With 2.2 kΩ, the pin
+ *   sinks at most about 2.3 mA. The resistor adds a constant charge time, which is subtracted from each measurement.
+ */
+#define AXIS_MEASUREMENT_ADC 0
+#define AXIS_MEASUREMENT_RC_TIMING 1
+
+#define AXIS_MEASUREMENT AXIS_MEASUREMENT_ADC
+
+#define RC_TIMING_CAPACITOR_NF 150
+#define RC_TIMING_SERIES_RESISTOR_OHM 2200
+#define RC_TIMING_RANGE_CHANNEL 4
+#define RC_TIMING_DISCHARGE_US 50
+
+/**
+ * Axis modes:
+ * - AXIS_MODE_ANALOG: The axis is a potentiometer, measured with range selection and oversampling.
+ * - AXIS_MODE_DISCRETE: The axis encodes a few discrete positions, like the hat switches of ThrustMaster FCS or
+ *   CH sticks, which use a few fixed resistances on an axis. It is measured with a single conversion in the highest
+ *   range, and the result is snapped to the nearest level in DISCRETE_AXIS_LEVELS.
+ *   The oversampling setting of a discrete axis is ignored.
+ */
+#define AXIS_MODE_ANALOG 0
+#define AXIS_MODE_DISCRETE 1
+
+#define AXIS_1_MODE AXIS_MODE_ANALOG
+#define AXIS_2_MODE AXIS_MODE_ANALOG
+#define AXIS_3_MODE AXIS_MODE_ANALOG
+#define AXIS_4_MODE AXIS_MODE_ANALOG
+
+/**
+ * Expected axis positions of a discrete axis, each paired with the hat switch direction reported for it.
+ * Hat switch directions are 0 (up) to 7 (up-left) in clockwise order, 8 is the centered (null) state.
+ * The defaults match a hat with four evenly spaced resistances and an open circuit when centered.
+ */
+#define DISCRETE_AXIS_LEVEL_COUNT 5
+#define DISCRETE_AXIS_LEVELS { {-2047, 0}, {-1024, 2}, {0, 4}, {1024, 6}, {2047, 8} }
+
+/**
+ * Additionally reports the snapped value of the given discrete axis (1-4) as a HID hat switch,
+ * using the padding bits of the report. 0 disables the hat switch.
+ */
+#define HAT_SWITCH_AXIS 0
+
+/**
+ * Number of digital buttons, either 4 or 8. Buttons 1-4 are connected to Port C 0-3.
+ * In 8 button mode, buttons 5-8 are connected to Port D 1, 5, 6 and 7, for example for the second joystick of a
+ * Y-cable. The additional buttons use the padding bits of the report, so they can not be combined with the hat switch.
+ */
+#define BUTTON_COUNT 4
+
+/**
+ * Number of joysticks, either 1 or 2. The second joystick uses axis 5-8, selected through the upper half of the
+ * 3 bit axis multiplexer, and buttons 5-8, so it requires BUTTON_COUNT set to 8. Each joystick is reported with its
+ * own HID report ID as a separate joystick. The axis of the second joystick use the settings of the corresponding
+ * axis of the first one.
+ */
+#define JOYSTICK_COUNT 1
+
+/**
+ * Number of axis and buttons. Each joystick has 4 axis and reports its share of the buttons.
+ */
+#define AXIS_COUNT (4 * JOYSTICK_COUNT)
+#define JOYSTICK_BUTTON_COUNT (BUTTON_COUNT / JOYSTICK_COUNT)
+
+/**
+ * Separate button report. With BUTTON_REPORT set to 1, each joystick has two reports: an axis report with only the
+ * axis, and a 2 byte button report with the buttons and the hat switch. Each usage is declared in only one of them.
+ * Only the report whose values changed is sent, so button changes do not wait for the axis.
+ * With BUTTON_REPORT set to 0, a single report holds the axis, buttons and hat switch.
+ */
+#define BUTTON_REPORT 1
+
+/**
+ * HID report IDs. The reports use IDs, if there are multiple joysticks or button reports. The axis reports of the
+ * joysticks come first, followed by their button reports.
+ */
+#define REPORT_IDS (JOYSTICK_COUNT > 1 || BUTTON_REPORT)
+#define JOYSTICK_REPORT_ID(joystick) ((joystick) + 1)
+#define BUTTON_REPORT_ID(joystick) (JOYSTICK_COUNT + (joystick) + 1)
+
+/**
+ * Oversampling of each axis. An axis measurement consists of 4^n conversions, which are summed up and decimated
+ * to gain n additional bits of resolution. Allowed values for n are 0 to 3, i.e. 1, 4, 16 or 64 conversions.
+ * 
+ * Higher values give a steadier and finer axis value, but delay every other axis measurement.
+ * So use high values for slow axis like throttles and use 0 for digital hats and fast axis,
+ * which should be reported with minimum latency.
+ */
+#define AXIS_1_OVERSAMPLING_BITS 1
+#define AXIS_2_OVERSAMPLING_BITS 1
+#define AXIS_3_OVERSAMPLING_BITS 2
+#define AXIS_4_OVERSAMPLING_BITS 0
+
+/**
+ * Median prefilter of each axis, applied to each conversion before the oversampling.
+ * Rejects single-sample dropouts of worn potentiometers, which the averaging would otherwise spread into the result.
+ * Allowed values are 0 (disabled), 3 or 5, the number of consecutive conversions the median is taken from.
+ * The filter delays the axis by 1 (median of 3) or 2 (median of 5) conversions. Discrete axis are never filtered.
+ */
+#define AXIS_1_MEDIAN_FILTER 3
+#define AXIS_2_MEDIAN_FILTER 3
+#define AXIS_3_MEDIAN_FILTER 3
+#define AXIS_4_MEDIAN_FILTER 0
+
+/**
+ * Adaptive low-pass filter of each axis, applied to each axis measurement. See adaptive_filter() in filter.h.
+ * AXIS_n_FILTER_MIN_ALPHA is the smoothing factor of a resting axis in 8.8 fixed point (256 disables the filter),
+ * AXIS_n_FILTER_BETA the increase of the smoothing factor per position step per measurement of axis speed, in 4.4
+ * fixed point. The parameters can be changed at runtime using joystick_set_filter_parameters().
+ */
+#define AXIS_1_FILTER_MIN_ALPHA 32
+#define AXIS_1_FILTER_BETA 64
+#define AXIS_2_FILTER_MIN_ALPHA 32
+#define AXIS_2_FILTER_BETA 64
+#define AXIS_3_FILTER_MIN_ALPHA 32
+#define AXIS_3_FILTER_BETA 64
+#define AXIS_4_FILTER_MIN_ALPHA 256
+#define AXIS_4_FILTER_BETA 0
+
+/**
+ * Largest change of each axis that does not make the device send a new report, in units of the measurement: ADC codes,
+ * or Timer1 counts with AXIS_MEASUREMENT_RC_TIMING. Such changes, like noise, are only sent along with other changes
+ * or when the idle period set by the host with SET_IDLE expires.
+ * The sampling engine converts the threshold into calibrated position steps at the current range and position,
+ * as one ADC code means a different number of position steps depending on both. It applies relative to the last
+ * sent report, so noise of ±1 code needs a threshold of 2 on an unfiltered axis. The filtered axis use 1.
+ * Discrete axis report every level change.
+ */
+#define AXIS_1_REPORT_THRESHOLD 1
+#define AXIS_2_REPORT_THRESHOLD 1
+#define AXIS_3_REPORT_THRESHOLD 1
+#define AXIS_4_REPORT_THRESHOLD 2
+
+/**
+ * The axis speed used by the adaptive filter is smoothed with a factor of 1/2^n.
+ */
+#define ADAPTIVE_FILTER_SPEED_SMOOTHING_BITS 2
+
+/**
+ * Threshold in CPU cycles for counting slow runs of the adaptive filter. Runs exceeding it are only counted, the
+ * filter is not shortened.
+ * Not done yet: the cost of the filter has neither been measured on hardware nor counted from the generated
+ * assembly, so there is no verified cycle budget. The value 200 is arbitrary and must not be read as one.
+ * Measure the filter with FILTER_CYCLE_MEASUREMENT and replace it with a budget based on the measured worst case.
+ * 
+ * If FILTER_CYCLE_MEASUREMENT is set to 1, Timer1 counts CPU cycles and the filter runtime is measured for each
+ * measurement. The worst case and the number of measurements exceeding the budget can be read using
+ * joystick_get_filter_cycles(). The measurement includes the time spent in the USB interrupt,
+ * if it interrupts the filter.
+ */
+#define ADAPTIVE_FILTER_CYCLE_BUDGET 200
+#define FILTER_CYCLE_MEASUREMENT 0
+
+/**
+ * Online auto-calibration. If enabled, the calibration of each analog axis follows the axis:
+ * - The calibrated minimum and maximum are widened to the most extreme positions measured.
+ * - While the axis rests within AUTO_CALIBRATION_CENTER_WINDOW position steps around the calibrated center,
+ *   the center follows the axis position with a smoothing factor of 1/2^AUTO_CALIBRATION_CENTER_TRACKING_BITS.
+ * Without a stored calibration, the calibration starts with AUTO_CALIBRATION_INITIAL_SPAN position steps on both
+ * sides of the center, so that a single sweep of the axis reaches the full logical range.
+ * 
+ * The learned calibration is stored in the EEPROM, once it differs from the stored calibration by at least
+ * AUTO_CALIBRATION_SAVE_THRESHOLD position steps and no axis widened its range for
+ * AUTO_CALIBRATION_SAVE_DELAY_FRAMES frames.
+ */
+#define AUTO_CALIBRATION 1
+#define AUTO_CALIBRATION_INITIAL_SPAN 512
+#define AUTO_CALIBRATION_CENTER_WINDOW 256
+#define AUTO_CALIBRATION_CENTER_TRACKING_BITS 6
+#define AUTO_CALIBRATION_SAVE_THRESHOLD 32
+#define AUTO_CALIBRATION_SAVE_DELAY_FRAMES 30000
+
+/**
+ * Button debouncing. A button has to be stable for BUTTON_DEBOUNCE_TICKS debounce ticks (1 ms each) to change its
+ * state. With BUTTON_DEBOUNCE_FAST_ACCEPT set to 1, the first edge of a button that was stable for that long is
+ * taken right away and the following bounces are rejected. With 0, each edge is delayed by the debounce time.
+ */
+#define BUTTON_DEBOUNCE_TICKS 5
+#define BUTTON_DEBOUNCE_FAST_ACCEPT 1
+
+/**
+ * Maximum value for the AXIS_n_OVERSAMPLING_BITS.
+ */
+#define AXIS_OVERSAMPLING_MAX_BITS 3
+
+/**
+ * Low latency profile. With LOW_LATENCY_PROFILE set to 1, the interrupt endpoint announces a poll interval of
+ * LOW_LATENCY_POLL_INTERVAL_MS, instead of 100 ms. 10 ms is the shortest interval allowed for low speed devices.
+ * The frames are shortened, so that the sampling engine completes a fresh frame within each poll interval.
+ * This is checked at compile time for the configured axis settings.
+ */
+#define LOW_LATENCY_PROFILE 0
+#define LOW_LATENCY_POLL_INTERVAL_MS 10
+
+/**
+ * USB frame timebase. With SOF_TIMEBASE set to 1, the USB driver counts the keep-alive signals the host sends to low
+ * speed devices once per 1 ms frame, and clock_usb_frames() returns the frame count. The idle periods of the reports
+ * are then timed in frames, so they stay aligned to the host clock.
+ * The keep-alive signal is only seen on D-, so the USB interrupt uses the pin change interrupt of D- (PCINT20 on
+ * Port D 4) instead of INT0. This occupies pin change interrupt 2, so it can not be combined with 8 buttons and
+ * BUTTON_DEBOUNCE_FAST_ACCEPT.
+ */
+#define SOF_TIMEBASE 0
+
+/**
+ * Number of axis measurements per published frame. Every axis is measured at least once per frame,
+ * the remaining measurements are given to the axis that are currently moving.
+ */
+#if LOW_LATENCY_PROFILE
+#define MEASUREMENTS_PER_FRAME (AXIS_COUNT + 2)
+#elif JOYSTICK_COUNT > 1
+#define MEASUREMENTS_PER_FRAME 12
+#else
+#define MEASUREMENTS_PER_FRAME 8
+#endif
+
+/**
+ * Minimum activity, i.e. smoothed axis speed in position steps per measurement, for an axis to be considered moving.
+ */
+#define AXIS_ACTIVITY_THRESHOLD 4
+
+/**
+ * ADC clock profiles:
+ * - ADC_PROFILE_PRECISION: 100 kHz ADC clock with full 10 bit precision. For throttles and rudders.
+ * - ADC_PROFILE_DEFAULT: 200 kHz ADC clock, the upper limit for 10 bit precision.
+ * - ADC_PROFILE_FAST: 400 kHz ADC clock with 8 bit precision. For digital hats and buttons encoded as an axis.
+ */
+#define ADC_PROFILE_PRECISION 0
+#define ADC_PROFILE_DEFAULT 1
+#define ADC_PROFILE_FAST 2
+
+/**
+ * ADC clock profile used for each axis after startup.
+ */
+#define AXIS_1_ADC_PROFILE ADC_PROFILE_DEFAULT
+#define AXIS_2_ADC_PROFILE ADC_PROFILE_DEFAULT
+#define AXIS_3_ADC_PROFILE ADC_PROFILE_PRECISION
+#define AXIS_4_ADC_PROFILE ADC_PROFILE_DEFAULT
+
+/**
+ * ADC conversion triggering:
+ * - 0: Each conversion is started by the ADC interrupt as soon as the previous one completed. This gives the highest
+ *   sample rate, but the time between two samples varies with the ADC profile and the interrupt latency.
+ * - 1: The Timer0 compare match auto-triggers the ADC every ADC_AUTO_TRIGGER_PERIOD_US, and the ADC interrupt only
+ *   collects the results. The samples are equally spaced in time, independent of USB traffic.
+ *   The period must cover the slowest ADC profile, ADC_PROFILE_PRECISION, which needs 135 µs per conversion.
+ *   It also becomes the Timer0 clock tick, so it has to be a multiple of 5 µs.
+ */
+#define ADC_AUTO_TRIGGER 0
+#define ADC_AUTO_TRIGGER_PERIOD_US 160
+
+#endif // JOYSTICK_CONFIG_H_INCLUDED
@@ -0,0 +1,28 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RC_TIMING_H_INCLUDED
+#define RC_TIMING_H_INCLUDED
+
+/**
+ * Starts the RC timing measurement engine, which measures the axis in the background using the analog comparator
+ * and Timer1. Used instead of the ADC engine, if AXIS_MEASUREMENT is AXIS_MEASUREMENT_RC_TIMING.
+ * Called by joystick_start_sampling().
+ */
+void rc_timing_start();
+
+#endif // RC_TIMING_H_INCLUDED
@@ -21,7 +21,9 @@
 
 #include <avr/pgmspace.h>
 
-extern const PROGMEM uint8_t usbDescriptorHidReport[54];
+#include "usbconfig.h"
+
+extern const PROGMEM uint8_t usbDescriptorHidReport[USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH];
 
 
 #endif // USB_DESCRIPTOR_H_INCLUDED
@@ -0,0 +1,65 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef VENDOR_REQUESTS_H_INCLUDED
+#define VENDOR_REQUESTS_H_INCLUDED
+
+/* Vendor specific control requests, used to configure and diagnose the device.
+ * All requests use the device as recipient.
+ */
+
+/**
+ * Returns the struct axis_calibration_t of the axis given in wIndex.
+ */
+#define VENDOR_REQUEST_GET_CALIBRATION 1
+
+/**
+ * Sets a single calibration field of an axis to the value given in wValue.
+ * The low byte of wIndex selects the axis, the high byte selects the field, see CALIBRATION_FIELD_MINIMUM and
+ * following.
+ */
+#define VENDOR_REQUEST_SET_CALIBRATION 2
+
+/**
+ * Stores the current calibration of all axis in the EEPROM.
+ */
+#define VENDOR_REQUEST_SAVE_CALIBRATION 3
+
+/**
+ * Returns the number of presses of each button since startup, one byte per button.
+ */
+#define VENDOR_REQUEST_GET_BUTTON_PRESS_COUNTS 4
+
+/**
+ * Returns the struct button_edges_t with the times of the most recent debounced button edges, relative to the latest
+ * interrupt report.
+ */
+#define VENDOR_REQUEST_GET_BUTTON_EDGES 5
+
+/**
+ * Returns the struct report_ages_t with the ages of the values in the latest interrupt report of the joystick given
+ * in wIndex.
+ */
+#define VENDOR_REQUEST_GET_REPORT_AGES 6
+
+/**
+ * Returns the struct report_statistics_t with the number of sent interrupt reports with the axis, the number of stale
+ * reports, which did not contain a new frame, and the number of sent button reports.
+ */
+#define VENDOR_REQUEST_GET_REPORT_STATISTICS 7
+
+#endif // VENDOR_REQUESTS_H_INCLUDED
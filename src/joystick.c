@@ -17,16 +17,94 @@
 #include <stdint.h>
 
 #include <avr/io.h>
+#include <avr/pgmspace.h>
 #include <avr/interrupt.h>
-#include <avr/sleep.h>
+#include <util/atomic.h>
+#include <util/delay.h>
+#include <util/delay_basic.h>
 
+#include "axis_table.h"
+#include "buttons.h"
+#include "calibration.h"
+#include "clock.h"
+#include "filter.h"
 #include "joystick.h"
+#include "joystick_config.h"
+#include "rc_timing.h"
 
 
+#if JOYSTICK_COUNT != 1 && JOYSTICK_COUNT != 2
+#error "JOYSTICK_COUNT must be 1 or 2"
+#endif
+
+#if JOYSTICK_COUNT > 1 && BUTTON_COUNT != 8
+#error "The second joystick requires BUTTON_COUNT set to 8"
+#endif
+
+#if LOW_LATENCY_PROFILE && LOW_LATENCY_POLL_INTERVAL_MS < 10
+#error "Low speed devices must not use a poll interval below 10 ms"
+#endif
+
+/**
+ * Stores the most recent report of each joystick. Used to send a data packet over USB.
+ * Only accessed from the main loop, so the USB code can never see a partially updated report.
+ */
+struct joystick_report_t joystick_read_result[JOYSTICK_COUNT];
+
+#if BUTTON_REPORT
 /**
- * Stores the most recent joystick read. Used to send a data packet over USB.
+ * Stores the most recent button report of each joystick. Only accessed from the main loop.
  */
-struct joystick_read_t joystick_read_result;
+struct joystick_button_report_t joystick_button_report[JOYSTICK_COUNT];
+#endif
+
+_Static_assert(sizeof(struct joystick_report_t) <= 8, "The report has to fit into a single interrupt packet");
+
+/* The ADC interrupt publishes complete axis frames through a double buffer. It fills the buffer
+ * that is currently not published and publishes it by incrementing frame_sequence once all axis are
+ * measured. The published buffer is always frame_buffer[frame_sequence & 1].
+ * 
+ * The reader does not disable interrupts. Instead it copies the published buffer and checks that
+ * frame_sequence did not change in the meantime. If it did, the interrupt may have started to overwrite
+ * the copied buffer, so the copy is repeated.
+ */
+static struct joystick_read_t frame_buffer[2][JOYSTICK_COUNT];
+static volatile uint8_t frame_sequence;
+
+/**
+ * Times the axis values in frame_buffer were measured, as given by clock_micros(). Published with the frame.
+ */
+static uint32_t frame_sample_time[2][AXIS_COUNT];
+
+/**
+ * State of the reports of a joystick. The frame, sample times, frame sequence number and button byte belong to the
+ * latest report built by read_joystick(), the sent_ fields to the latest report sent. Changes are detected relative
+ * to the sent report. The button byte includes the hat switch. sent holds the REPORT_CHANGED_* flags of the parts
+ * that were sent at least once.
+ */
+struct report_state_t {
+    struct joystick_read_t frame;
+    uint32_t sample_time[4];
+    uint8_t frame_sequence;
+    uint8_t buttons;
+    struct joystick_read_t sent_frame;
+    uint8_t sent_buttons;
+    uint8_t sent_frame_sequence;
+    uint8_t sent;
+};
+
+/* Report state and ages of the values in the latest sent report of each joystick, and the report counters.
+ * Only used by the main loop.
+ */
+static struct report_state_t report_state[JOYSTICK_COUNT];
+static struct report_ages_t report_ages[JOYSTICK_COUNT];
+static struct report_statistics_t report_statistics;
+
+/**
+ * Prevents the compiler from moving memory accesses across this point.
+ * Used to order the plain frame_buffer accesses relative to the volatile frame_sequence accesses.
+ */
+#define memory_barrier() __asm__ __volatile__ ("" ::: "memory")
 
 /* Analog axis use a 100kΩ potentiometer connected to Vcc. To read such an axis,
  * the current resistance has to be determined, which can be done by building
@@ -41,7 +119,9 @@ struct joystick_read_t joystick_read_result;
  * axis changes rather slowly (unless it’s a digital hat),
  * so the optimum measurement range is likely the same between measurements of the same axis.
  * 
- * If the last measurement is above or below the optimal range, the previous or next range is tried.
+ * The range for the next measurement of an axis is chosen after each measurement, based on a prediction
+ * of the next axis value. Every measurement uses exactly one range, so a moving axis never causes
+ * additional conversions.
  */
 #define AXIS_RANGE_BITS 2
 
@@ -50,6 +130,12 @@ struct axis_state_t {
     uint8_t axis_2 : AXIS_RANGE_BITS;
     uint8_t axis_3 : AXIS_RANGE_BITS;
     uint8_t axis_4 : AXIS_RANGE_BITS;
+#if JOYSTICK_COUNT > 1
+    uint8_t axis_5 : AXIS_RANGE_BITS;
+    uint8_t axis_6 : AXIS_RANGE_BITS;
+    uint8_t axis_7 : AXIS_RANGE_BITS;
+    uint8_t axis_8 : AXIS_RANGE_BITS;
+#endif
 } current_axis_range;
 
 
@@ -67,6 +153,20 @@ inline void select_resistor(const uint8_t axis, const uint8_t new_multiplexer_ch
         case(3):
             current_axis_range.axis_4 = new_multiplexer_channel & 0x03;
             break;
+#if JOYSTICK_COUNT > 1
+        case(4):
+            current_axis_range.axis_5 = new_multiplexer_channel & 0x03;
+            break;
+        case(5):
+            current_axis_range.axis_6 = new_multiplexer_channel & 0x03;
+            break;
+        case(6):
+            current_axis_range.axis_7 = new_multiplexer_channel & 0x03;
+            break;
+        case(7):
+            current_axis_range.axis_8 = new_multiplexer_channel & 0x03;
+            break;
+#endif
         default:
             break;
     }
@@ -83,11 +183,23 @@ const inline uint8_t get_selected_resistor(const uint8_t axis) {
             return current_axis_range.axis_3;
         case(3):
             return current_axis_range.axis_4;
+#if JOYSTICK_COUNT > 1
+        case(4):
+            return current_axis_range.axis_5;
+        case(5):
+            return current_axis_range.axis_6;
+        case(6):
+            return current_axis_range.axis_7;
+        case(7):
+            return current_axis_range.axis_8;
+#endif
         default:
             return 0;
     }
 }
 
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
 /**
  * If the ADC measures a value above ADC_UPPER_THRESHOLD, the axis has a too low resistance,
  * so the voltage divider should switch to the next-lower resistor, for better accuracy.
@@ -98,29 +210,348 @@ const inline uint8_t get_selected_resistor(const uint8_t axis) {
 /**
  * If the ADC measures a value below ADC_LOWER_THRESHOLD, the axis has a too high resistance,
  * so the voltage divider should switch to the next-higher resistor, for better accuracy.
+ * Below this value, the resolution of the axis position drops quickly, as the position is proportional to 1/ADC code.
  */
-#define ADC_LOWER_THRESHOLD 0x00F
+#define ADC_LOWER_THRESHOLD 0x100
 
+/**
+ * The predicted axis position has to pass the position of the range’s ADC_UPPER_THRESHOLD or ADC_LOWER_THRESHOLD
+ * by this amount to switch the measurement range. This keeps an axis resting near a switching point from
+ * toggling the range with every measurement.
+ */
+#define AXIS_RANGE_HYSTERESIS 16
 
-ISR(ADC_vect) {
-    /* Called when the ADC interrupt wakes the device. Nothing to do here.
-     * The only purpose is to implicitly clear the interrupt flags in SREG and ADCSRA,
-     * and to wake up the CPU that sleeps during the conversion.
-     */
-}
+/**
+ * Axis positions corresponding to the range switching thresholds of each range.
+ * A larger ADC code means a lower axis resistance, which is a lower axis position.
+ */
+#define AXIS_RANGE_SWITCHING_POINTS(range_resistor) { \
+    AXIS_POSITION(range_resistor, ADC_UPPER_THRESHOLD), AXIS_POSITION(range_resistor, ADC_LOWER_THRESHOLD) }
+
+static const int16_t axis_range_switching_points[4][2] = {
+    AXIS_RANGE_SWITCHING_POINTS(AXIS_RANGE_0_RESISTOR_OHM),
+    AXIS_RANGE_SWITCHING_POINTS(AXIS_RANGE_1_RESISTOR_OHM),
+    AXIS_RANGE_SWITCHING_POINTS(AXIS_RANGE_2_RESISTOR_OHM),
+    AXIS_RANGE_SWITCHING_POINTS(AXIS_RANGE_3_RESISTOR_OHM),
+};
+#endif
 
+/**
+ * The highest selectable measurement range. Ranges are ordered by ascending resistor value.
+ */
+#define AXIS_RANGE_MAX (_BV(AXIS_RANGE_BITS) - 1)
 
-void read_joystick() {
-    
-    /* Reads the four digital buttons from Port C 0-3
-     */
-    joystick_read_result.buttons = PINC & 0x0F;
+/**
+ * Motion of an axis, used to predict the axis position of the next measurement.
+ * The velocity is given in axis position steps per measurement.
+ * The activity is the smoothed absolute velocity, used to distribute the measurements among the axis.
+ */
+struct axis_motion_t {
+    int16_t last_position;
+    int16_t velocity;
+    uint16_t activity;
+};
+
+static struct axis_motion_t axis_motion[AXIS_COUNT];
+
+#if AUTO_CALIBRATION
+/**
+ * Axis extent learned by the auto-calibration: the most extreme positions measured and the position of the resting
+ * axis. The center uses AUTO_CALIBRATION_CENTER_FRACTION_BITS fractional bits.
+ */
+#define AUTO_CALIBRATION_CENTER_FRACTION_BITS 4
+
+struct axis_learning_t {
+    int16_t minimum;
+    int16_t maximum;
+    int16_t center;
+};
+
+static struct axis_learning_t axis_learning[AXIS_COUNT];
+
+/**
+ * Number of published frames since an axis last widened its learned extent. Saturates.
+ */
+static uint16_t frames_since_extent_change;
+#endif
+
+#if AXIS_1_OVERSAMPLING_BITS > AXIS_OVERSAMPLING_MAX_BITS || AXIS_2_OVERSAMPLING_BITS > AXIS_OVERSAMPLING_MAX_BITS \
+        || AXIS_3_OVERSAMPLING_BITS > AXIS_OVERSAMPLING_MAX_BITS || AXIS_4_OVERSAMPLING_BITS > AXIS_OVERSAMPLING_MAX_BITS
+#error "The oversampling of an axis is limited to AXIS_OVERSAMPLING_MAX_BITS"
+#endif
+
+#if (HAT_SWITCH_AXIS == 1 && AXIS_1_MODE != AXIS_MODE_DISCRETE) || (HAT_SWITCH_AXIS == 2 && AXIS_2_MODE != AXIS_MODE_DISCRETE) \
+        || (HAT_SWITCH_AXIS == 3 && AXIS_3_MODE != AXIS_MODE_DISCRETE) \
+        || (HAT_SWITCH_AXIS == 4 && AXIS_4_MODE != AXIS_MODE_DISCRETE) || HAT_SWITCH_AXIS > 4
+#error "HAT_SWITCH_AXIS must refer to a discrete axis"
+#endif
+
+/**
+ * Initializer of a per axis array from the settings of the four axis of the first joystick.
+ * The axis of the second joystick use the same settings.
+ */
+#if JOYSTICK_COUNT > 1
+#define PER_AXIS(axis_1, axis_2, axis_3, axis_4) axis_1, axis_2, axis_3, axis_4, axis_1, axis_2, axis_3, axis_4
+#else
+#define PER_AXIS(axis_1, axis_2, axis_3, axis_4) axis_1, axis_2, axis_3, axis_4
+#endif
+
+static const uint8_t axis_report_threshold[AXIS_COUNT] = {
+    PER_AXIS(AXIS_1_REPORT_THRESHOLD, AXIS_2_REPORT_THRESHOLD, AXIS_3_REPORT_THRESHOLD, AXIS_4_REPORT_THRESHOLD)
+};
+
+/**
+ * Report threshold of each axis in calibrated position steps, derived from axis_report_threshold at the latest
+ * measured position. Written by the sampling engine, read by the main loop. Discrete axis keep a threshold of 0,
+ * so every level change is reported.
+ */
+static volatile uint8_t axis_report_threshold_steps[AXIS_COUNT];
+
+static const uint8_t axis_mode[AXIS_COUNT] = {
+    PER_AXIS(AXIS_1_MODE, AXIS_2_MODE, AXIS_3_MODE, AXIS_4_MODE)
+};
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+/**
+ * Number of additional bits gained by oversampling, per axis. Each axis measurement consists of 4^n conversions.
+ * Discrete axis are always measured with a single conversion.
+ */
+#define AXIS_OVERSAMPLING(mode, bits) ((mode) == AXIS_MODE_DISCRETE ? 0 : (bits))
+
+static const uint8_t axis_oversampling_bits[AXIS_COUNT] = {
+    PER_AXIS(
+        AXIS_OVERSAMPLING(AXIS_1_MODE, AXIS_1_OVERSAMPLING_BITS), AXIS_OVERSAMPLING(AXIS_2_MODE, AXIS_2_OVERSAMPLING_BITS),
+        AXIS_OVERSAMPLING(AXIS_3_MODE, AXIS_3_OVERSAMPLING_BITS), AXIS_OVERSAMPLING(AXIS_4_MODE, AXIS_4_OVERSAMPLING_BITS))
+};
+
+#define VALID_MEDIAN_FILTER(size) ((size) == 0 || (size) == 3 || (size) == 5)
+#if !VALID_MEDIAN_FILTER(AXIS_1_MEDIAN_FILTER) || !VALID_MEDIAN_FILTER(AXIS_2_MEDIAN_FILTER) \
+        || !VALID_MEDIAN_FILTER(AXIS_3_MEDIAN_FILTER) || !VALID_MEDIAN_FILTER(AXIS_4_MEDIAN_FILTER)
+#error "The median filter size of an axis must be 0, 3 or 5"
+#endif
+
+/**
+ * Size of the median prefilter, per axis. Discrete axis snap each single conversion, so they are never filtered.
+ */
+#define AXIS_MEDIAN_FILTER(mode, size) ((mode) == AXIS_MODE_DISCRETE ? 0 : (size))
+
+static const uint8_t axis_median_filter[AXIS_COUNT] = {
+    PER_AXIS(
+        AXIS_MEDIAN_FILTER(AXIS_1_MODE, AXIS_1_MEDIAN_FILTER), AXIS_MEDIAN_FILTER(AXIS_2_MODE, AXIS_2_MEDIAN_FILTER),
+        AXIS_MEDIAN_FILTER(AXIS_3_MODE, AXIS_3_MEDIAN_FILTER), AXIS_MEDIAN_FILTER(AXIS_4_MODE, AXIS_4_MEDIAN_FILTER))
+};
+
+/**
+ * The most recent conversions of an axis, used by the median prefilter.
+ * Conversions of different ranges can not be compared, so the window is refilled when the range changes.
+ */
+struct median_window_t {
+    uint16_t values[5];
+    uint8_t next_index;
+    uint8_t range;
+};
+
+static struct median_window_t median_window[AXIS_COUNT];
+#endif
+
+/**
+ * Adaptive low-pass filter state and parameters of each axis.
+ */
+#define FILTER_PARAMETERS(axis) {AXIS_##axis##_FILTER_MIN_ALPHA, AXIS_##axis##_FILTER_BETA}
+
+static struct adaptive_filter_t axis_filter[AXIS_COUNT];
+static struct adaptive_filter_parameters_t axis_filter_parameters[AXIS_COUNT] = {
+    PER_AXIS(FILTER_PARAMETERS(1), FILTER_PARAMETERS(2), FILTER_PARAMETERS(3), FILTER_PARAMETERS(4))
+};
+
+#if FILTER_CYCLE_MEASUREMENT
+static struct filter_cycles_t filter_cycles;
+#endif
+
+/**
+ * A position of a discrete axis and the hat switch direction reported for it.
+ */
+struct discrete_level_t {
+    int16_t position;
+    uint8_t hat_switch;
+};
+
+static const PROGMEM struct discrete_level_t discrete_axis_levels[DISCRETE_AXIS_LEVEL_COUNT] = DISCRETE_AXIS_LEVELS;
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+/* ADC clock profiles. Each axis is converted with the ADC clock of its profile, which is set when the
+ * conversion is started. Datasheet: 28.4. Prescaling and Conversion Timing, page 308:
+ * “If a lower resolution than 10 bits is needed, the input clock frequency to the ADC can be higher than 200kHz
+ * to get a higher sample rate.”
+ * 
+ * So the fast profile only reads the upper 8 bits of the result, which are left adjusted in ADCH by setting ADLAR.
+ * Datasheet 28.9.3. ADC Data Register Low (ADLAR=1), page 322:
+ * “If the result is left adjusted and no more than 8-bit precision is required, it is sufficient to read ADCH.”
+ */
+#define ADC_PROFILE_COUNT 3
+
+/**
+ * ADPS bits of ADCSRA for each profile: F_CPU/128 = 100 kHz, F_CPU/64 = 200 kHz, F_CPU/32 = 400 kHz.
+ */
+static const uint8_t adc_profile_prescaler_bits[ADC_PROFILE_COUNT] = {
+    _BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0),
+    _BV(ADPS2) | _BV(ADPS1),
+    _BV(ADPS2) | _BV(ADPS0),
+};
+
+/**
+ * The smallest prescaler used by any profile. The multiplexer settle times are computed for this prescaler,
+ * as it leaves the least time to settle.
+ */
+#define ADC_PRESCALER 32
+
+#if ADC_AUTO_TRIGGER
+/**
+ * Duration of an auto triggered conversion with the slowest profile in µs, rounded up.
+ * Datasheet: 28.4. Prescaling and Conversion Timing, Table 28-1: An auto triggered conversion takes 13.5 ADC clock
+ * cycles.
+ */
+#define ADC_SLOWEST_CONVERSION_US ((27UL * 128 * 1000000UL + 2 * F_CPU - 1) / (2 * F_CPU))
+
+#if ADC_AUTO_TRIGGER_PERIOD_US <= ADC_SLOWEST_CONVERSION_US
+#error "ADC_AUTO_TRIGGER_PERIOD_US is shorter than a conversion with ADC_PROFILE_PRECISION"
+#endif
+
+/**
+ * Time between the starts of two conversions in µs. With auto triggering, this is the trigger period.
+ */
+#define ADC_CONVERSION_US ADC_AUTO_TRIGGER_PERIOD_US
+#else
+/**
+ * Duration of a conversion in µs. Datasheet: 28.4. Prescaling and Conversion Timing, page 308:
+ * “A normal conversion takes 13 ADC clock cycles.”
+ */
+#define ADC_CONVERSION_US (13UL * ADC_PRESCALER * 1000000UL / F_CPU)
+#endif
+
+/**
+ * CPU cycles between writing ADSC and the end of the sample-and-hold phase in the worst case.
+ * Datasheet: 28.4. Prescaling and Conversion Timing, page 308:
+ * “When initiating a single ended conversion by setting the ADC Start Conversion bit (ADSC) in ADCSRA, the
+ *  conversion starts at the following rising edge of the ADC clock cycle.”
+ * “The actual sample-and-hold takes place 1.5 ADC clock cycles after the start of a normal conversion”
+ * The conversion starts up to one ADC clock cycle after writing ADSC, so the sample-and-hold phase ends up to
+ * 2.5 ADC clock cycles after it. After that, the ADC input may change without affecting the running conversion.
+ */
+#define ADC_SAMPLE_AND_HOLD_CYCLES(prescaler) (5 * (prescaler) / 2)
+
+/**
+ * Iterations of _delay_loop_1() covering the sample-and-hold phase for each profile, rounded up.
+ * Each iteration takes 3 CPU cycles.
+ */
+static const uint8_t adc_profile_sample_and_hold_loops[ADC_PROFILE_COUNT] = {
+    (ADC_SAMPLE_AND_HOLD_CYCLES(128) + 2) / 3,
+    (ADC_SAMPLE_AND_HOLD_CYCLES(64) + 2) / 3,
+    (ADC_SAMPLE_AND_HOLD_CYCLES(32) + 2) / 3,
+};
+
+/**
+ * ADC clock profile of each axis. Can be changed at runtime using joystick_set_adc_profile().
+ */
+static uint8_t axis_adc_profile[AXIS_COUNT] = {
+    PER_AXIS(AXIS_1_ADC_PROFILE, AXIS_2_ADC_PROFILE, AXIS_3_ADC_PROFILE, AXIS_4_ADC_PROFILE)
+};
+
+#if ADC_AUTO_TRIGGER
+/**
+ * Time in µs an external multiplexer has to settle, if it is switched right after a conversion completed.
+ * This is the time left until the next trigger.
+ */
+#define ADC_HIDDEN_SETTLE_US (ADC_AUTO_TRIGGER_PERIOD_US - ADC_SLOWEST_CONVERSION_US)
+#else
+/**
+ * Time in µs an external multiplexer has to settle, if it is switched right after waiting for the sample-and-hold
+ * phase. This is the remaining duration of the running conversion, if it started right when ADSC was written:
+ * 13 - 2.5 ADC clock cycles.
+ */
+#define ADC_HIDDEN_SETTLE_US ((13UL * 2 - 5) * ADC_PRESCALER * 1000000UL / (2 * F_CPU))
+#endif
+
+/**
+ * Number of conversions that have to be discarded after switching a multiplexer stage with the given settle time,
+ * because the remaining duration of the running conversion is not sufficient to let it settle.
+ */
+#define SETTLE_CONVERSIONS(settle_us) ((settle_us) > ADC_HIDDEN_SETTLE_US \
+    ? ((settle_us) - ADC_HIDDEN_SETTLE_US + ADC_CONVERSION_US - 1) / ADC_CONVERSION_US \
+    : 0)
+
+#define AXIS_MULTIPLEXER_SETTLE_CONVERSIONS SETTLE_CONVERSIONS(AXIS_MULTIPLEXER_SETTLE_US)
+#define RANGE_MULTIPLEXER_SETTLE_CONVERSIONS SETTLE_CONVERSIONS(RANGE_MULTIPLEXER_SETTLE_US)
+
+#if LOW_LATENCY_PROFILE
+/* Worst case duration of a frame in µs with the configured axis settings: Every axis is measured once, and all
+ * remaining measurements of the frame go to the axis with the longest measurement.
+ * The ADC profile values are ordered by prescaler, so a profile converts with the CPU clock divided by 128 >> profile.
+ */
+#if ADC_AUTO_TRIGGER
+#define PROFILE_CONVERSION_US(adc_profile) ADC_AUTO_TRIGGER_PERIOD_US
+#else
+#define PROFILE_CONVERSION_US(adc_profile) (13UL * (128 >> (adc_profile)) * 1000000UL / F_CPU)
+#endif
+#define AXIS_MEASUREMENT_US(axis) ((1UL << 2 * AXIS_OVERSAMPLING(AXIS_##axis##_MODE, AXIS_##axis##_OVERSAMPLING_BITS)) \
+    * PROFILE_CONVERSION_US(AXIS_##axis##_ADC_PROFILE))
+#define LONGER_MEASUREMENT_US(first, second) ((first) > (second) ? (first) : (second))
+#define LONGEST_MEASUREMENT_US LONGER_MEASUREMENT_US( \
+    LONGER_MEASUREMENT_US(AXIS_MEASUREMENT_US(1), AXIS_MEASUREMENT_US(2)), \
+    LONGER_MEASUREMENT_US(AXIS_MEASUREMENT_US(3), AXIS_MEASUREMENT_US(4)))
+#define FRAME_WORST_CASE_US (JOYSTICK_COUNT \
+    * (AXIS_MEASUREMENT_US(1) + AXIS_MEASUREMENT_US(2) + AXIS_MEASUREMENT_US(3) + AXIS_MEASUREMENT_US(4)) \
+    + (MEASUREMENTS_PER_FRAME - AXIS_COUNT) * LONGEST_MEASUREMENT_US)
+
+#if FRAME_WORST_CASE_US > LOW_LATENCY_POLL_INTERVAL_MS * 1000UL
+#error "A frame takes longer than the poll interval. Reduce the oversampling or use faster ADC profiles"
+#endif
+#endif
+
+/* The conversions are pipelined. While a conversion runs, the multiplexers are already switched to the input of
+ * the following conversion, as soon as the sample-and-hold phase of the running conversion ended.
+ * That way, the multiplexers settle while the ADC converts, instead of adding dead time between conversions.
+ * With ADC_AUTO_TRIGGER, the multiplexers are switched when a conversion completed, and settle until the next
+ * trigger.
+ * 
+ * Each conversion is described by a sample slot. The scheduler produces the slots in order,
+ * two slots ahead of the slot whose result is processed, or one slot ahead with ADC_AUTO_TRIGGER.
+ */
+struct sample_slot_t {
+    uint8_t axis : 3;
+    uint8_t range : AXIS_RANGE_BITS;
+    // The conversion only lets the multiplexers settle, its result is discarded.
+    uint8_t settling : 1;
+    // The conversion is the last one of an axis measurement.
+    uint8_t last : 1;
+    uint8_t adc_profile : 2;
+    // The conversion is the last one of the frame, which is published afterwards.
+    uint8_t frame_end : 1;
+};
+
+/* State of the scheduler, which produces the sample slots. scheduled_samples counts the conversions still missing
+ * in the axis measurement currently being scheduled, settle_conversions counts the remaining settling conversions.
+ * scheduled_range and scheduled_adc_profile are latched when the measurement is started, because the range of the
+ * axis may change, while slots of its measurement are still scheduled. All conversions of a measurement are summed
+ * up, so they have to use the same range.
+ * multiplexer_setting is the Port B value selecting the most recently scheduled slot.
+ */
+static uint8_t scheduled_axis;
+static uint8_t scheduled_range;
+static uint8_t scheduled_adc_profile;
+static uint8_t scheduled_samples;
+static uint8_t settle_conversions;
+static uint8_t multiplexer_setting;
+
+/* State of the background acquisition engine. It is only accessed by the ADC interrupt.
+ * converting_slot is the running conversion, next_slot the one the multiplexers are switched to.
+ */
+static struct sample_slot_t converting_slot;
+#if !ADC_AUTO_TRIGGER
+static struct sample_slot_t next_slot;
+#endif
+static uint16_t accumulator;
 
-//#pragma unroll(4)
-//    for (uint8_t axis = 0; axis < 4; ++axis) {
-//        joystick_read_result.axis[axis] = calibrate_and_read_axis(axis);
-//    }
-}
 
 /**
  * An ADC conversion result.
@@ -130,92 +561,718 @@ union adc_result_t {
     uint8_t bytes[2];
 };
 
-void joystick_set_analog_input_pin(const uint8_t channel) {
-    /* Datasheet: 28.9.1. ADC Multiplexer Selection Register, page 317:
-     * - Only allow the plain 8 ADC channels.
-     * - Make sure that the channel selection can not write the upper 3 bits (bits 5, 6 & 7).
-     * - Do not reset the upper 3 bits REFS1, REFS0, ADLAR.
+
+static inline uint16_t adc_read_result(const struct sample_slot_t slot) {
+    if (slot.adc_profile == ADC_PROFILE_FAST) {
+        // 8 bit result, left adjusted. Scale it to 10 bits, so that all profiles return the same range.
+        return ADCH << 2;
+    }
+    union adc_result_t result;
+    /* Datasheet 28.9.3. ADC Data Register Low (ADLAR=0), page 321:
+     * “ADCL must be read first, then ADCH.”
+     * 
+     * The datasheet does not indicate what the upper 5 bits of ADCH read when accessed,
+     * so strip them out when read.
      */
-    ADMUX = (channel & 0x7) | (ADMUX & 0xE0);
+    result.bytes[0] = ADCL;
+    result.bytes[1] = ADCH & 0x3;
+    return result.result;
 }
 
 
-uint16_t calibrate_and_read_axis(const uint8_t axis) {
-    uint8_t should_step_down, should_step_up;
-    uint16_t axis_value;
-    do {
-        const uint8_t selected_resistor = get_selected_resistor(axis);
-        /* Reads the analog axis.
-        * 
-        * First ORed term selects the measurement range by selecting a
-        * resistor in the resistor battery multiplexer.
-        * 
-        * The second term selects the axis in the axis multiplexer.
-        */
-        PINB = selected_resistor | axis << 3;
-        axis_value = analog_read();
-        
-        should_step_down = selected_resistor && (axis_value > ADC_UPPER_THRESHOLD);
-        should_step_up = ((selected_resistor + 1) & ~_BV(AXIS_RANGE_BITS)) && (axis_value < ADC_LOWER_THRESHOLD);
-        
-        if (should_step_down) {
-            select_resistor(axis, selected_resistor + 1);
-        } else if (should_step_up) {
-            select_resistor(axis, selected_resistor - 1);
+static inline void select_multiplexers(const struct sample_slot_t slot) {
+    /* Selects the measurement range by selecting a resistor in the resistor battery multiplexer (bits 0-2)
+     * and the axis in the axis multiplexer (bits 3-5).
+     * The upper two bits of Port B are unused inputs with enabled pull-ups, so keep them as they are.
+     */
+    PORTB = (PORTB & 0xC0) | slot.range | slot.axis << 3;
+}
+
+
+/* Datasheet: 28.9.2. ADC Control and Status Register A, page 319:
+ * “ADIF is cleared by writing a logical one to the flag.”
+ * The conversion of the next slot may complete while the interrupt handler runs, so the register must be written
+ * without the ADIF bit set. Otherwise, the pending interrupt is cleared and the sampling stops.
+ */
+#define ADCSRA_WITHOUT_ADIF (ADCSRA & ~_BV(ADIF))
+
+
+static inline void start_conversion(const struct sample_slot_t slot) {
+    /* Set up the ADC clock and result adjustment of the slot’s profile. Changing ADLAR affects the data register
+     * immediately, so this must only be done after the previous result is read.
+     */
+    if (slot.adc_profile == ADC_PROFILE_FAST) {
+        ADMUX |= _BV(ADLAR);
+    } else {
+        ADMUX &= ~_BV(ADLAR);
+    }
+#if ADC_AUTO_TRIGGER
+    /* Datasheet: 28.3. Starting a Conversion, page 307:
+     * “A conversion will be triggered by the rising edge of the selected Interrupt Flag.”
+     * The conversion is started by the next Timer0 compare match, so only set up the ADC clock.
+     */
+    ADCSRA = (ADCSRA_WITHOUT_ADIF & ~(_BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0)))
+            | adc_profile_prescaler_bits[slot.adc_profile];
+#else
+    /* Datasheet: 28.3. Starting a Conversion, page 307:
+     * “A single conversion is started by writing a '0' to the Power Reduction ADC bit in the Power Reduction
+     * Register (PRR.PRADC), and writing a '1' to the ADC Start Conversion bit in the ADC Control and Status
+     * Register A (ADCSRA.ADSC).”
+     */
+    ADCSRA = (ADCSRA_WITHOUT_ADIF & ~(_BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0)))
+            | adc_profile_prescaler_bits[slot.adc_profile]
+            | _BV(ADSC);
+#endif
+}
+
+
+static inline void wait_for_sample_and_hold(const struct sample_slot_t slot) {
+    _delay_loop_1(adc_profile_sample_and_hold_loops[slot.adc_profile]);
+}
+#endif
+
+
+#if MEASUREMENTS_PER_FRAME < AXIS_COUNT
+#error "MEASUREMENTS_PER_FRAME must allow at least one measurement per axis"
+#endif
+
+/**
+ * The axis measurements of the current frame, in the order they are taken, and the index of the next one.
+ */
+static uint8_t frame_schedule[MEASUREMENTS_PER_FRAME];
+static uint8_t frame_schedule_index;
+
+
+/**
+ * Returns the axis measured at the given position of a measurement round.
+ * With two joysticks, the rounds alternate between the joysticks, so that both are measured evenly over the frame.
+ */
+#if JOYSTICK_COUNT > 1
+#define INTERLEAVED_AXIS(index) (((index) >> 1) | ((index) & 1) << 2)
+#else
+#define INTERLEAVED_AXIS(index) (index)
+#endif
+
+/**
+ * Plans the axis measurements of the next frame.
+ * 
+ * Every axis is measured at least once per frame, so that no axis starves. The remaining measurements are
+ * given to the most active axis. Each additional measurement halves the activity of the axis it is given to,
+ * so that multiple moving axis share them. If no axis is active, they are distributed evenly.
+ * The measurements are interleaved, so that the additional measurements of an axis are spread over the frame.
+ */
+static void plan_frame() {
+    uint8_t measurements[AXIS_COUNT];
+    uint16_t remaining_activity[AXIS_COUNT];
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+        measurements[axis] = 1;
+        remaining_activity[axis] = axis_motion[axis].activity;
+    }
+    for (uint8_t additional = MEASUREMENTS_PER_FRAME - AXIS_COUNT; additional > 0; --additional) {
+        uint8_t most_active_axis = INTERLEAVED_AXIS(additional & (AXIS_COUNT - 1));
+        uint16_t highest_activity = AXIS_ACTIVITY_THRESHOLD;
+        for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+            if (remaining_activity[axis] >= highest_activity) {
+                highest_activity = remaining_activity[axis];
+                most_active_axis = axis;
+            }
         }
-    } while(should_step_down || should_step_up);
-    /* Now, the axis is in the proper range, so read it 3 additional times and average the result of all four reads.
-     * TODO: Is this sufficient for a fast-changing axis? If not, instead average the result of 4 calibrate_and_read_axis() calls
-     * or ditch the averaging completely.
+        remaining_activity[most_active_axis] /= 2;
+        ++measurements[most_active_axis];
+    }
+    uint8_t index = 0;
+    for (uint8_t round = 0; index < MEASUREMENTS_PER_FRAME; ++round) {
+        for (uint8_t round_index = 0; round_index < AXIS_COUNT; ++round_index) {
+            const uint8_t axis = INTERLEAVED_AXIS(round_index);
+            if (measurements[axis] > round) {
+                frame_schedule[index++] = axis;
+            }
+        }
+    }
+}
+
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+static inline struct sample_slot_t schedule_next_slot() {
+    struct sample_slot_t slot = {
+        .axis = scheduled_axis,
+        .range = scheduled_range,
+        .settling = 0,
+        .last = 0,
+        .adc_profile = scheduled_adc_profile,
+        .frame_end = 0,
+    };
+    if (settle_conversions) {
+        --settle_conversions;
+        slot.settling = 1;
+        return slot;
+    }
+    if (scheduled_samples == 0) {
+        // Start the measurement of the next axis. Its range was chosen, when it was measured the last time.
+        if (frame_schedule_index == MEASUREMENTS_PER_FRAME) {
+            plan_frame();
+            frame_schedule_index = 0;
+        }
+        scheduled_axis = frame_schedule[frame_schedule_index++];
+        scheduled_range = get_selected_resistor(scheduled_axis);
+        scheduled_adc_profile = axis_adc_profile[scheduled_axis];
+        scheduled_samples = 1 << (2 * axis_oversampling_bits[scheduled_axis]);
+        slot.axis = scheduled_axis;
+        slot.range = scheduled_range;
+        slot.adc_profile = scheduled_adc_profile;
+    }
+    /* Insert settling conversions, if the multiplexers have to be switched and the settle time of the switched stage
+     * exceeds the remaining duration of the running conversion.
      */
-    return analog_read4(axis_value);
+    const uint8_t new_multiplexer_setting = slot.range | slot.axis << 3;
+    uint8_t required_settle_conversions = 0;
+    if ((new_multiplexer_setting ^ multiplexer_setting) & 0x38) {
+        required_settle_conversions = AXIS_MULTIPLEXER_SETTLE_CONVERSIONS;
+    }
+    if ((new_multiplexer_setting ^ multiplexer_setting) & 0x07
+            && required_settle_conversions < RANGE_MULTIPLEXER_SETTLE_CONVERSIONS) {
+        required_settle_conversions = RANGE_MULTIPLEXER_SETTLE_CONVERSIONS;
+    }
+    multiplexer_setting = new_multiplexer_setting;
+    if (required_settle_conversions) {
+        settle_conversions = required_settle_conversions - 1;
+        slot.settling = 1;
+        return slot;
+    }
+    --scheduled_samples;
+    slot.last = scheduled_samples == 0;
+    slot.frame_end = slot.last && frame_schedule_index == MEASUREMENTS_PER_FRAME;
+    return slot;
 }
+#endif
 
-uint16_t analog_read() {
-    /* Enter ADC Noise Reduction Mode
-     * Datasheet: 14.5. ADC Noise Reduction Mode, page 63:
-     * “When the SM[2:0] bits are written to '001', the SLEEP instruction makes the MCU enter ADC Noise
-     * Reduction mode, stopping the CPU but allowing the ADC, the external interrupts, […] to continue
-     * operating (if enabled).”
-     * 
-     * “If the ADC is enabled, a conversion starts automatically when this mode is entered.”
+
+static inline void update_axis_motion(const uint8_t axis, const int16_t position) {
+    struct axis_motion_t *motion = &axis_motion[axis];
+
+    // Smooth the velocity by averaging the previous velocity and the latest change.
+    motion->velocity = (motion->velocity + (position - motion->last_position)) / 2;
+    motion->last_position = position;
+    const uint16_t speed = motion->velocity < 0 ? -motion->velocity : motion->velocity;
+    motion->activity = (3 * motion->activity + speed) / 4;
+}
+
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+static inline void select_next_axis_range(const uint8_t axis, const int16_t position) {
+    const uint8_t selected_resistor = get_selected_resistor(axis);
+
+    /* Extrapolate the axis position of the next measurement and choose the range for it now.
+     * At most a single range step is taken per measurement.
      */
-    set_sleep_mode(SLEEP_MODE_ADC);
-    sleep_enable();
-    sleep_cpu();
-
-    /* The CPU might have been woken up by an interrupt caused by the USB interface. In this case,
-     * go to sleep again, until the conversion is completed.
-     * Datasheet: 28.3. Starting a Conversion, page 307:
-     * “ADCS will stay high as long as the conversion is in progress, and will be
-     * cleared by hardware when the conversion is completed.”
+    const int16_t predicted_position = position + axis_motion[axis].velocity;
+    if (selected_resistor > 0
+            && predicted_position < axis_range_switching_points[selected_resistor][0] - AXIS_RANGE_HYSTERESIS) {
+        select_resistor(axis, selected_resistor - 1);
+    } else if (selected_resistor < AXIS_RANGE_MAX
+            && predicted_position > axis_range_switching_points[selected_resistor][1] + AXIS_RANGE_HYSTERESIS) {
+        select_resistor(axis, selected_resistor + 1);
+    }
+}
+#endif
+
+
+#if AUTO_CALIBRATION
+static inline void learn_axis_extent(const uint8_t axis, const int16_t position) {
+    struct axis_learning_t *learning = &axis_learning[axis];
+    if (position < learning->minimum) {
+        learning->minimum = position;
+        frames_since_extent_change = 0;
+    } else if (position > learning->maximum) {
+        learning->maximum = position;
+        frames_since_extent_change = 0;
+    }
+    /* Only a resting axis near the center moves the center. That way, an axis held deflected,
+     * like a throttle, keeps the center in place.
      */
-    while (ADCSRA & _BV(ADSC)) {
-        sleep_cpu();
+    const int16_t center_offset = position - (learning->center >> AUTO_CALIBRATION_CENTER_FRACTION_BITS);
+    if (axis_motion[axis].activity < AXIS_ACTIVITY_THRESHOLD
+            && center_offset > -AUTO_CALIBRATION_CENTER_WINDOW && center_offset < AUTO_CALIBRATION_CENTER_WINDOW) {
+        learning->center += (position * _BV(AUTO_CALIBRATION_CENTER_FRACTION_BITS) - learning->center)
+                >> AUTO_CALIBRATION_CENTER_TRACKING_BITS;
+    }
+}
+#endif
+
+
+/**
+ * Returns the level of a discrete axis closest to the given position.
+ */
+static inline const struct discrete_level_t *snap_discrete_axis(const int16_t position) {
+    const struct discrete_level_t *closest_level = discrete_axis_levels;
+    uint16_t closest_distance = UINT16_MAX;
+    for (const struct discrete_level_t *level = discrete_axis_levels;
+            level < discrete_axis_levels + DISCRETE_AXIS_LEVEL_COUNT; ++level) {
+        const int16_t difference = position - (int16_t) pgm_read_word(&level->position);
+        const uint16_t distance = difference < 0 ? -difference : difference;
+        if (distance < closest_distance) {
+            closest_distance = distance;
+            closest_level = level;
+        }
     }
-    sleep_disable();
+    return closest_level;
+}
 
-    // Conversion finished, the result can be read.
-    union adc_result_t result;
-    /* Datasheet 28.9.3. ADC Data Register Low (ADLAR=0), page 321:
-     * “ADCL must be read first, then ADCH.”
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+static inline uint16_t median_filter(const struct sample_slot_t slot, const uint16_t adc_value) {
+    const uint8_t size = axis_median_filter[slot.axis];
+    if (size == 0) {
+        return adc_value;
+    }
+    struct median_window_t *window = &median_window[slot.axis];
+    if (window->range != slot.range) {
+        for (uint8_t index = 0; index < 5; ++index) {
+            window->values[index] = adc_value;
+        }
+        window->range = slot.range;
+    }
+    window->values[window->next_index] = adc_value;
+    if (++window->next_index == size) {
+        window->next_index = 0;
+    }
+    return size == 3 ? median3(window->values) : median5(window->values);
+}
+#endif
+
+
+static inline int16_t filter_axis(const uint8_t axis, const int16_t position) {
+#if FILTER_CYCLE_MEASUREMENT
+    const uint16_t start = TCNT1;
+#endif
+    const int16_t filtered_position = adaptive_filter(&axis_filter[axis], &axis_filter_parameters[axis], position);
+#if FILTER_CYCLE_MEASUREMENT
+    const uint16_t cycles = TCNT1 - start;
+    if (cycles > filter_cycles.worst_case) {
+        filter_cycles.worst_case = cycles;
+    }
+    if (cycles > ADAPTIVE_FILTER_CYCLE_BUDGET) {
+        ++filter_cycles.budget_overruns;
+    }
+#endif
+    return filtered_position;
+}
+
+
+/**
+ * Converts the report threshold of the given axis from measurement units into calibrated position steps at the
+ * given measured position.
+ */
+static inline void update_report_threshold(const uint8_t axis, const int16_t position, const uint16_t position_step) {
+    // Round the threshold up to whole position steps. The product has at most 24 bits.
+    const uint16_t threshold = ((uint32_t) axis_report_threshold[axis] * position_step + 255) >> 8;
+    const uint16_t calibrated_threshold = calibration_scale_distance(axis, position, threshold);
+    axis_report_threshold_steps[axis] = calibrated_threshold > UINT8_MAX ? UINT8_MAX : calibrated_threshold;
+}
+
+
+void joystick_process_axis_measurement(const uint8_t axis, int16_t position, const uint16_t position_step,
+        const uint8_t frame_end) {
+    // Each joystick has its own report, which holds its four axis.
+    struct joystick_read_t *frame = &frame_buffer[(frame_sequence + 1) & 1][axis >> 2];
+    if (axis_mode[axis] == AXIS_MODE_DISCRETE) {
+        // Discrete axis stay in the highest range, which separates all levels well enough.
+        const struct discrete_level_t *level = snap_discrete_axis(position);
+        position = pgm_read_word(&level->position);
+#if HAT_SWITCH_AXIS
+        if ((axis & 0x03) == HAT_SWITCH_AXIS - 1) {
+            frame->hat_switch = pgm_read_byte(&level->hat_switch);
+        }
+#endif
+    } else {
+        update_axis_motion(axis, position);
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+        // The range prediction needs the unfiltered position, as the filter lags behind the axis.
+        select_next_axis_range(axis, position);
+#endif
+        position = filter_axis(axis, position);
+#if AUTO_CALIBRATION
+        learn_axis_extent(axis, position);
+#endif
+        // Calibrate last, so that the deadzone is not disturbed by noise.
+        const int16_t measured_position = position;
+        position = calibration_apply(axis, position);
+        update_report_threshold(axis, measured_position, position_step);
+    }
+    frame->axis[axis & 0x03] = position;
+    frame_sample_time[(frame_sequence + 1) & 1][axis] = clock_micros();
+    if (frame_end) {
+        // All axis are measured, so publish the frame.
+        memory_barrier();
+        ++frame_sequence;
+#if AUTO_CALIBRATION
+        if (frames_since_extent_change < UINT16_MAX) {
+            ++frames_since_extent_change;
+        }
+#endif
+    }
+}
+
+
+uint8_t joystick_schedule_next_axis(uint8_t *frame_end) {
+    if (frame_schedule_index == MEASUREMENTS_PER_FRAME) {
+        plan_frame();
+        frame_schedule_index = 0;
+    }
+    const uint8_t axis = frame_schedule[frame_schedule_index++];
+    *frame_end = frame_schedule_index == MEASUREMENTS_PER_FRAME;
+    return axis;
+}
+
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+static inline void process_sample(const struct sample_slot_t slot, const uint16_t adc_value) {
+    /* Each axis is measured with a fixed number of conversions in the range selected in advance,
+     * so the time needed for a full sampling pass does not depend on the axis values.
+     * Each individual component has 10 bit accuracy,
+     * the sum of up to 64 samples therefore uses at most 16 bits, which fits into a single uint16_t.
+     */
+    if (slot.settling) {
+        return;
+    }
+    accumulator += median_filter(slot, adc_value);
+    if (slot.last) {
+        /* Decimate the sum of 4^n conversions by n bits, which gives n additional bits of resolution.
+         * Then scale all axis to the same fixed point format with AXIS_OVERSAMPLING_MAX_BITS fractional bits.
+         */
+        const uint8_t oversampling_bits = axis_oversampling_bits[slot.axis];
+        const uint16_t oversampled_value = (accumulator >> oversampling_bits)
+                << (AXIS_OVERSAMPLING_MAX_BITS - oversampling_bits);
+        accumulator = 0;
+        // Fold the used range into the measurement, so that the result is a continuous axis position.
+        joystick_process_axis_measurement(slot.axis, axis_position(slot.range, oversampled_value),
+                axis_position_step(slot.range, oversampled_value), slot.frame_end);
+    }
+}
+
+
+#if ADC_AUTO_TRIGGER
+ISR(ADC_vect, ISR_NOBLOCK) {
+    /* Called when a conversion is completed. The conversions are started by Timer0 at a fixed rate, so this routine
+     * only collects the result and prepares the next conversion. It runs with interrupts enabled (ISR_NOBLOCK),
+     * to not delay the USB interrupt. Disable the ADC interrupt meanwhile, to not re-enter this routine.
+     */
+    ADCSRA = ADCSRA_WITHOUT_ADIF & ~_BV(ADIE);
+    const struct sample_slot_t finished_slot = converting_slot;
+    const uint16_t adc_value = adc_read_result(finished_slot);
+
+    // The multiplexers settle until the next trigger samples the input.
+    converting_slot = schedule_next_slot();
+    select_multiplexers(converting_slot);
+    start_conversion(converting_slot);
+
+    process_sample(finished_slot, adc_value);
+    ADCSRA = ADCSRA_WITHOUT_ADIF | _BV(ADIE);
+}
+#else
+ISR(ADC_vect, ISR_NOBLOCK) {
+    /* Called when a conversion is completed. V-USB requires that the USB interrupt is never blocked for more
+     * than a few cycles, so this routine runs with interrupts enabled (ISR_NOBLOCK).
      * 
-     * The datasheet does not indicate what the upper 5 bits of ADCH read when accessed,
-     * so strip them out when read.
+     * The next conversion is started right away, so this routine might still run, when it completes.
+     * Disable the ADC interrupt meanwhile, to not re-enter this routine. A conversion completed in the meantime
+     * keeps its interrupt flag set and is handled right after returning.
      */
-    result.bytes[0] = ADCL;
-    result.bytes[1] = ADCH & 0x3;
+    ADCSRA = ADCSRA_WITHOUT_ADIF & ~_BV(ADIE);
+    const struct sample_slot_t finished_slot = converting_slot;
+    const uint16_t adc_value = adc_read_result(finished_slot);
 
-    return result.result;
+    // The multiplexers are already switched to the next slot and settled during the finished conversion.
+    converting_slot = next_slot;
+    start_conversion(converting_slot);
+
+    // Switch the multiplexers to the slot following the started conversion, as soon as its input is sampled.
+    next_slot = schedule_next_slot();
+    wait_for_sample_and_hold(converting_slot);
+    select_multiplexers(next_slot);
+
+    process_sample(finished_slot, adc_value);
+    ADCSRA = ADCSRA_WITHOUT_ADIF | _BV(ADIE);
 }
+#endif
+#endif
 
-uint16_t analog_read4(uint16_t result) {
-    // Compute the arithmetic mean of 4 results.
-    // Each individual component has 10 bit accuracy,
-    // the sum therefore uses at most 12 bits, which fits into a single uint16_t.
-    result += analog_read();
-    result += analog_read();
-    result += analog_read();
-    result >>= 2;
-    return result;
+
+void joystick_start_sampling() {
+    frame_schedule_index = MEASUREMENTS_PER_FRAME;
+#if REPORT_IDS
+    for (uint8_t joystick = 0; joystick < JOYSTICK_COUNT; ++joystick) {
+        joystick_read_result[joystick].report_id = JOYSTICK_REPORT_ID(joystick);
+#if BUTTON_REPORT
+        joystick_button_report[joystick].report_id = BUTTON_REPORT_ID(joystick);
+#endif
+    }
+#endif
+    for (uint8_t axis = 0; axis < AXIS_COUNT; ++axis) {
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+        if (axis_mode[axis] == AXIS_MODE_DISCRETE) {
+            select_resistor(axis, AXIS_RANGE_MAX);
+        }
+        // Force refilling the median windows with the first conversion.
+        median_window[axis].range = 0xFF;
+#endif
+#if AUTO_CALIBRATION
+        // Learning starts from the loaded calibration.
+        struct axis_calibration_t calibration;
+        calibration_get(axis, &calibration);
+        joystick_set_learned_extent(axis, &calibration);
+#endif
+    }
+    joystick_set_analog_input_pin(4);
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_RC_TIMING
+    rc_timing_start();
+#else
+    scheduled_axis = 0;
+    scheduled_samples = 0;
+    settle_conversions = 0;
+    multiplexer_setting = 0xFF;
+    accumulator = 0;
+
+    // Let the multiplexers settle for the first slot.
+    converting_slot = schedule_next_slot();
+    select_multiplexers(converting_slot);
+    _delay_us(AXIS_MULTIPLEXER_SETTLE_US + RANGE_MULTIPLEXER_SETTLE_US);
+    start_conversion(converting_slot);
+#if ADC_AUTO_TRIGGER
+    /* Datasheet: 28.9.4. ADC Control and Status Register B, page 323:
+     * Trigger the conversions with the Timer/Counter0 Compare Match A (ADTS = 011).
+     * Datasheet: 28.9.2. ADC Control and Status Register A, page 319:
+     * “When this bit is written to one, Auto Triggering of the ADC is enabled. The ADC will start a conversion on a
+     *  positive edge of the selected trigger signal.”
+     * The compare match A flag is cleared by the clock once per period, so each period has a positive edge.
+     */
+    ADCSRB = (ADCSRB & ~(_BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0))) | _BV(ADTS1) | _BV(ADTS0);
+    ADCSRA = ADCSRA_WITHOUT_ADIF | _BV(ADATE);
+#else
+    next_slot = schedule_next_slot();
+    wait_for_sample_and_hold(converting_slot);
+    select_multiplexers(next_slot);
+#endif
+#endif
+}
+
+
+/**
+ * Packs two axis values into three bytes of the report, as 12 bit two's complement numbers,
+ * least significant bits first. The values always lie within -2047 to 2047, so no bits are lost.
+ */
+static inline void pack_axis_pair(uint8_t *bytes, const int16_t first, const int16_t second) {
+    bytes[0] = (uint8_t) first;
+    bytes[1] = ((uint8_t) (first >> 8) & 0x0F) | (uint8_t) (second << 4);
+    bytes[2] = (uint8_t) (second >> 4);
+}
+
+
+/**
+ * Returns the REPORT_CHANGED_* flags of the built report of the given joystick, relative to its sent report:
+ * A button or the hat switch changed, or an axis moved by more than its report threshold.
+ */
+static inline uint8_t report_changes(const uint8_t joystick) {
+    const struct report_state_t *state = &report_state[joystick];
+    // Parts that were never sent count as changed.
+    uint8_t changes = (REPORT_CHANGED_BUTTONS | REPORT_CHANGED_AXIS) & ~state->sent;
+    if (changes & REPORT_CHANGED_AXIS) {
+        return changes;
+    }
+    if (state->buttons != state->sent_buttons) {
+        changes = REPORT_CHANGED_BUTTONS;
+    }
+    for (uint8_t axis = 0; axis < 4; ++axis) {
+        // The axis values lie within -2047 to 2047, so the difference can not overflow.
+        int16_t change = state->frame.axis[axis] - state->sent_frame.axis[axis];
+        if (change < 0) {
+            change = -change;
+        }
+        if (change > axis_report_threshold_steps[joystick * 4 + axis]) {
+            return changes | REPORT_CHANGED_AXIS;
+        }
+    }
+    return changes;
+}
+
+
+uint8_t read_joystick(const uint8_t joystick) {
+    // Copy the sample times along with the frame, using the same consistency check.
+    struct report_state_t *state = &report_state[joystick];
+    uint8_t sequence;
+    do {
+        sequence = joystick_get_frame(joystick, &state->frame);
+        for (uint8_t axis = 0; axis < 4; ++axis) {
+            state->sample_time[axis] = frame_sample_time[sequence & 1][joystick * 4 + axis];
+        }
+        memory_barrier();
+    } while (sequence != frame_sequence);
+    state->frame_sequence = sequence;
+
+    struct joystick_report_t *report = &joystick_read_result[joystick];
+    pack_axis_pair(&report->axis[0], state->frame.axis[0], state->frame.axis[1]);
+    pack_axis_pair(&report->axis[3], state->frame.axis[2], state->frame.axis[3]);
+
+    /* Reads the debounced digital buttons of the joystick, including presses that were released since the last
+     * report. Each joystick has JOYSTICK_BUTTON_COUNT buttons, starting with the first joystick.
+     * A latched press always differs from the sent report, unless the button was already pressed in it, so it is
+     * never dropped.
+     */
+    const uint8_t button_shift = joystick * JOYSTICK_BUTTON_COUNT;
+    uint8_t buttons = buttons_read((uint8_t) (_BV(JOYSTICK_BUTTON_COUNT) - 1) << button_shift) >> button_shift;
+#if HAT_SWITCH_AXIS
+    buttons |= state->frame.hat_switch << 4;
+#endif
+    state->buttons = buttons;
+#if BUTTON_REPORT
+    joystick_button_report[joystick].buttons = buttons;
+#else
+    report->buttons = buttons;
+#endif
+    return report_changes(joystick);
+}
+
+
+void joystick_report_sent(const uint8_t joystick, const uint8_t button_report) {
+    struct report_state_t *state = &report_state[joystick];
+    const uint32_t report_time = clock_micros();
+    if (button_report) {
+        ++report_statistics.button_reports;
+    } else {
+        // The report is stale, if the sampling engine did not publish a new frame since the previous report.
+        ++report_statistics.reports;
+        if (state->sent & REPORT_CHANGED_AXIS && state->frame_sequence == state->sent_frame_sequence) {
+            ++report_statistics.stale_reports;
+        }
+        state->sent_frame = state->frame;
+        state->sent_frame_sequence = state->frame_sequence;
+        state->sent |= REPORT_CHANGED_AXIS;
+
+        // The report was just handed to the USB driver, so take the ages relative to now.
+        struct report_ages_t *ages = &report_ages[joystick];
+        for (uint8_t axis = 0; axis < 4; ++axis) {
+            ages->axis_age_us[axis] = report_time - state->sample_time[axis];
+        }
+    }
+#if BUTTON_REPORT
+    if (!button_report) {
+        // The axis report does not contain the buttons.
+        return;
+    }
+#endif
+    state->sent_buttons = state->buttons;
+    state->sent |= REPORT_CHANGED_BUTTONS;
+    report_ages[joystick].buttons_age_us = report_time - buttons_get_sample_time();
+    buttons_report_sent(report_time);
+}
+
+
+void joystick_get_report_ages(const uint8_t joystick, struct report_ages_t *ages) {
+    *ages = report_ages[joystick & (JOYSTICK_COUNT - 1)];
+}
+
+
+void joystick_get_report_statistics(struct report_statistics_t *statistics) {
+    *statistics = report_statistics;
+}
+
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_ADC
+void joystick_set_adc_profile(const uint8_t axis, const uint8_t adc_profile) {
+    if (adc_profile < ADC_PROFILE_COUNT) {
+        // Takes effect with the next measurement of the axis.
+        axis_adc_profile[axis & (AXIS_COUNT - 1)] = adc_profile;
+    }
+}
+#endif
+
+
+uint8_t joystick_get_axis_mode(const uint8_t axis) {
+    return axis_mode[axis & (AXIS_COUNT - 1)];
+}
+
+
+void joystick_set_filter_parameters(const uint8_t axis, const uint16_t min_alpha, const uint8_t beta) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        axis_filter_parameters[axis & (AXIS_COUNT - 1)].min_alpha = min_alpha;
+        axis_filter_parameters[axis & (AXIS_COUNT - 1)].beta = beta;
+    }
+}
+
+
+#if FILTER_CYCLE_MEASUREMENT
+void joystick_get_filter_cycles(struct filter_cycles_t *cycles) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        *cycles = filter_cycles;
+    }
+}
+#endif
+
+
+uint8_t joystick_get_frame(const uint8_t joystick, struct joystick_read_t *frame) {
+    uint8_t sequence;
+    do {
+        sequence = frame_sequence;
+        memory_barrier();
+        *frame = frame_buffer[sequence & 1][joystick];
+        memory_barrier();
+    } while (sequence != frame_sequence);
+    return sequence;
+}
+
+
+#if AUTO_CALIBRATION
+void joystick_get_learned_extent(const uint8_t axis, struct axis_calibration_t *extent) {
+    struct axis_learning_t learning;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        learning = axis_learning[axis & (AXIS_COUNT - 1)];
+    }
+    extent->minimum = learning.minimum;
+    // Round the center to the nearest position.
+    extent->center = (learning.center + _BV(AUTO_CALIBRATION_CENTER_FRACTION_BITS - 1))
+            >> AUTO_CALIBRATION_CENTER_FRACTION_BITS;
+    extent->maximum = learning.maximum;
+}
+
+
+void joystick_set_learned_extent(const uint8_t axis, const struct axis_calibration_t *extent) {
+    const struct axis_learning_t learning = {
+        .minimum = extent->minimum,
+        .maximum = extent->maximum,
+        .center = extent->center * _BV(AUTO_CALIBRATION_CENTER_FRACTION_BITS),
+    };
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        axis_learning[axis & (AXIS_COUNT - 1)] = learning;
+    }
+}
+
+
+uint16_t joystick_frames_since_extent_change() {
+    uint16_t frames;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        frames = frames_since_extent_change;
+    }
+    return frames;
+}
+#endif
+
+
+void joystick_set_analog_input_pin(const uint8_t channel) {
+    /* Datasheet: 28.9.1. ADC Multiplexer Selection Register, page 317:
+     * - Only allow the plain 8 ADC channels.
+     * - Make sure that the channel selection can not write the upper 3 bits (bits 5, 6 & 7).
+     * - Do not reset the upper 3 bits REFS1, REFS0, ADLAR.
+     */
+    ADMUX = (channel & 0x7) | (ADMUX & 0xE0);
+}
+
+
+int16_t calibrate_and_read_axis(const uint8_t axis) {
+    /* The measurement itself is done in the background by the ADC interrupt, which also selects the
+     * proper measurement range. So only fetch the most recent published result.
+     */
+    struct joystick_read_t frame;
+    joystick_get_frame((axis & (AXIS_COUNT - 1)) >> 2, &frame);
+    return frame.axis[axis & 0x03];
 }
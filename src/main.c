@@ -23,12 +23,41 @@
 
 #include "usbdrv.h"
 
+#include "buttons.h"
+#include "calibration.h"
+#include "clock.h"
 #include "hwinit.h"
 #include "joystick.h"
+#include "vendor_requests.h"
 
-extern struct joystick_read_t joystick_read_result;
+extern struct joystick_report_t joystick_read_result[JOYSTICK_COUNT];
+#if BUTTON_REPORT
+extern struct joystick_button_report_t joystick_button_report[JOYSTICK_COUNT];
+#endif
 
-uint8_t idleRate;   /* repeat rate for keyboards, never used for mice/joysticks */
+/**
+ * Idle rate of each joystick in 4 ms units, as set by the host with SET_IDLE. While the input does not change,
+ * the full report is repeated once per idle period. 0, the default for joysticks, only sends reports on changes.
+ * The button report of a joystick shares the idle rate of its full report.
+ */
+static uint8_t idle_rate[JOYSTICK_COUNT];
+
+/**
+ * Time the latest report with the axis of each joystick was sent, or its idle period expired, in µs, as given by
+ * report_clock().
+ */
+static uint32_t report_time[JOYSTICK_COUNT];
+
+/**
+ * Buffer for data returned by vendor requests.
+ */
+static union {
+    struct axis_calibration_t calibration;
+    uint8_t button_press_counts[BUTTON_COUNT];
+    struct button_edges_t button_edges;
+    struct report_ages_t report_ages;
+    struct report_statistics_t report_statistics;
+} vendor_reply;
 
 /**
  * Reset the watchdog.
@@ -40,6 +69,24 @@ static inline void watchdog_reset() {
     PIND &= ~_BV(PIND3);
 }
 
+/**
+ * Returns the joystick of the given report ID, which is either its axis report or its button report.
+ * Without report IDs, there only is the first joystick.
+ */
+static inline uint8_t report_id_joystick(const uint8_t report_id) {
+#if REPORT_IDS
+    if(report_id >= JOYSTICK_REPORT_ID(0) && report_id <= JOYSTICK_REPORT_ID(JOYSTICK_COUNT - 1)){
+        return report_id - JOYSTICK_REPORT_ID(0);
+    }
+#if BUTTON_REPORT
+    if(report_id >= BUTTON_REPORT_ID(0) && report_id <= BUTTON_REPORT_ID(JOYSTICK_COUNT - 1)){
+        return report_id - BUTTON_REPORT_ID(0);
+    }
+#endif
+#endif
+    return 0;
+}
+
 usbMsgLen_t usbFunctionSetup(uint8_t data[8])
 {
     usbRequest_t *rq = (void *)data;
@@ -49,22 +96,146 @@ usbMsgLen_t usbFunctionSetup(uint8_t data[8])
      */
     if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_CLASS){    /* class request type */
         if(rq->bRequest == USBRQ_HID_GET_REPORT){  /* wValue: ReportType (highbyte), ReportID (lowbyte) */
-            /* we only have one report type, so don't look at wValue */
-            usbMsgPtr = (unsigned short) &joystick_read_result;
-            return sizeof(joystick_read_result);
-        }else if(rq->bRequest == USBRQ_HID_GET_IDLE){
-            usbMsgPtr = (unsigned short) &idleRate;
+            /* we only have input reports, so only look at the report ID */
+            const uint8_t joystick = report_id_joystick(rq->wValue.bytes[0]);
+#if BUTTON_REPORT
+            if(rq->wValue.bytes[0] >= BUTTON_REPORT_ID(0)){
+                usbMsgPtr = (unsigned short) &joystick_button_report[joystick];
+                return sizeof(joystick_button_report[joystick]);
+            }
+#endif
+            usbMsgPtr = (unsigned short) &joystick_read_result[joystick];
+            return sizeof(joystick_read_result[joystick]);
+        }else if(rq->bRequest == USBRQ_HID_GET_IDLE){  /* wValue: ReportID (lowbyte) */
+            usbMsgPtr = (unsigned short) &idle_rate[report_id_joystick(rq->wValue.bytes[0])];
             return 1;
-        }else if(rq->bRequest == USBRQ_HID_SET_IDLE){
-            idleRate = rq->wValue.bytes[1];
+        }else if(rq->bRequest == USBRQ_HID_SET_IDLE){  /* wValue: Duration (highbyte), ReportID (lowbyte) */
+            /* Report ID 0 sets the idle rate of all reports */
+            if(rq->wValue.bytes[0] == 0){
+                for(uint8_t joystick = 0; joystick < JOYSTICK_COUNT; ++joystick){
+                    idle_rate[joystick] = rq->wValue.bytes[1];
+                }
+            }else{
+                idle_rate[report_id_joystick(rq->wValue.bytes[0])] = rq->wValue.bytes[1];
+            }
+        }
+    } else if((rq->bmRequestType & USBRQ_TYPE_MASK) == USBRQ_TYPE_VENDOR){
+        if(rq->bRequest == VENDOR_REQUEST_GET_CALIBRATION){
+            calibration_get(rq->wIndex.bytes[0], &vendor_reply.calibration);
+            usbMsgPtr = (unsigned short) &vendor_reply.calibration;
+            return sizeof(vendor_reply.calibration);
+        }else if(rq->bRequest == VENDOR_REQUEST_SET_CALIBRATION){
+            calibration_set_field(rq->wIndex.bytes[0], rq->wIndex.bytes[1], rq->wValue.word);
+        }else if(rq->bRequest == VENDOR_REQUEST_SAVE_CALIBRATION){
+            calibration_save();
+        }else if(rq->bRequest == VENDOR_REQUEST_GET_BUTTON_PRESS_COUNTS){
+            buttons_get_press_counts(vendor_reply.button_press_counts);
+            usbMsgPtr = (unsigned short) vendor_reply.button_press_counts;
+            return sizeof(vendor_reply.button_press_counts);
+        }else if(rq->bRequest == VENDOR_REQUEST_GET_BUTTON_EDGES){
+            buttons_get_edges(&vendor_reply.button_edges);
+            usbMsgPtr = (unsigned short) &vendor_reply.button_edges;
+            return sizeof(vendor_reply.button_edges);
+        }else if(rq->bRequest == VENDOR_REQUEST_GET_REPORT_AGES){
+            joystick_get_report_ages(rq->wIndex.bytes[0], &vendor_reply.report_ages);
+            usbMsgPtr = (unsigned short) &vendor_reply.report_ages;
+            return sizeof(vendor_reply.report_ages);
+        }else if(rq->bRequest == VENDOR_REQUEST_GET_REPORT_STATISTICS){
+            joystick_get_report_statistics(&vendor_reply.report_statistics);
+            usbMsgPtr = (unsigned short) &vendor_reply.report_statistics;
+            return sizeof(vendor_reply.report_statistics);
         }
-    } else {
-        /* no vendor specific requests implemented */
     }
     return 0;   /* default for not implemented requests: return no data back to host */
 }
 
 
+/**
+ * The joystick whose report is sent next. The joysticks take turns.
+ */
+static uint8_t next_joystick;
+
+/**
+ * 1, while a report is queued and was not fetched by the host yet.
+ */
+static uint8_t report_queued;
+
+/**
+ * REPORT_CHANGED_* flags of the reports of each joystick, which still have to be sent. With BUTTON_REPORT,
+ * only one of the two reports can be queued at a time, so the other one stays pending until the next poll.
+ */
+static uint8_t pending_reports[JOYSTICK_COUNT];
+
+
+/**
+ * Returns the time in µs the reports are timed with. With SOF_TIMEBASE, this is the host’s frame clock,
+ * so the idle periods do not drift against the host polls.
+ */
+static inline uint32_t report_clock() {
+#if SOF_TIMEBASE
+    return clock_usb_frames() * 1000;
+#else
+    return clock_micros();
+#endif
+}
+
+
+/**
+ * Returns 1, if the idle period of the given joystick expired since its latest report.
+ */
+static inline uint8_t idle_period_expired(const uint8_t joystick, const uint32_t now) {
+    return idle_rate[joystick] && now - report_time[joystick] >= idle_rate[joystick] * 4000UL;
+}
+
+
+static void send_report() {
+    /* Only send a report if the input changed or the idle period expired. Otherwise, the endpoint stays
+     * idle and the host polls are answered with NAK, which saves bus traffic and host wakeups.
+     * While the calibration is written to the EEPROM, reports are sent continuously. Each fetched report tells
+     * calibration_task() that a host poll just passed.
+     */
+    const uint8_t joystick = next_joystick;
+    const uint32_t now = report_clock();
+    uint8_t pending = pending_reports[joystick] | read_joystick(joystick);
+    if(idle_period_expired(joystick, now)) {
+        // Repeat all reports of the joystick. The idle period restarts now, so they are only queued once.
+        pending = REPORT_CHANGED_BUTTONS | REPORT_CHANGED_AXIS;
+        report_time[joystick] = now;
+    }else if(calibration_write_pending()) {
+        pending |= REPORT_CHANGED_AXIS;
+    }
+#if BUTTON_REPORT
+    // Button changes go first, so they do not wait for the axis report.
+    if(pending & REPORT_CHANGED_BUTTONS) {
+        usbSetInterrupt((void *) &joystick_button_report[joystick], sizeof(joystick_button_report[joystick]));
+        joystick_report_sent(joystick, 1);
+        pending &= ~REPORT_CHANGED_BUTTONS;
+        report_queued = 1;
+    }else if(pending & REPORT_CHANGED_AXIS) {
+        usbSetInterrupt((void *) &joystick_read_result[joystick], sizeof(joystick_read_result[joystick]));
+        joystick_report_sent(joystick, 0);
+        report_time[joystick] = now;
+        pending &= ~REPORT_CHANGED_AXIS;
+        report_queued = 1;
+    }
+#else
+    if(pending) {
+        // Each report fits into a single interrupt packet.
+        usbSetInterrupt((void *) &joystick_read_result[joystick], sizeof(joystick_read_result[joystick]));
+        joystick_report_sent(joystick, 0);
+        report_time[joystick] = now;
+        pending = 0;
+        report_queued = 1;
+    }
+#endif
+    pending_reports[joystick] = pending;
+    // Stay with the joystick until all its pending reports are sent.
+    if(!pending && ++next_joystick == JOYSTICK_COUNT) {
+        next_joystick = 0;
+    }
+}
+
+
 int main() {
     hwinit();
     hwinit_debug();
@@ -74,13 +245,17 @@ int main() {
     watchdog_reset();
     usbDeviceConnect();
     watchdog_reset();
+    joystick_start_sampling();
     sei();
     for(;;) {
         usbPoll();
+        uint8_t report_fetched = 0;
         if(usbInterruptIsReady()) {
-            read_joystick();
-            usbSetInterrupt((void *) &joystick_read_result, sizeof(joystick_read_result));
+            report_fetched = report_queued;
+            report_queued = 0;
+            send_report();
         }
+        calibration_task(report_fetched);
         watchdog_reset();
     }
 }
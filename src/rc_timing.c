@@ -0,0 +1,189 @@
+/* Copyright (C) 2020 Thomas Hess <thomas.hess@udo.edu>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+
+#include <avr/interrupt.h>
+#include <avr/io.h>
+
+#include "axis_table.h"
+#include "joystick.h"
+#include "joystick_config.h"
+#include "rc_timing.h"
+
+#if AXIS_MEASUREMENT == AXIS_MEASUREMENT_RC_TIMING
+
+#if FILTER_CYCLE_MEASUREMENT
+#error "FILTER_CYCLE_MEASUREMENT uses Timer1, which is needed by the RC timing measurement"
+#endif
+
+/**
+ * ln(Vcc / (Vcc - Vbg)) in 1/1000 for Vcc = 5 V and the bandgap reference Vbg = 1.1 V. The capacitor voltage reaches
+ * the bandgap reference after this fraction of the RC time constant.
+ */
+#define RC_TIMING_THRESHOLD_LOG_PER_MILLE 249
+
+/**
+ * Timer1 counts (CPU cycles) until the capacitor reaches the bandgap reference when charged through the given
+ * resistance.
+ */
+#define RC_TIMING_COUNTS(ohm) ((ohm) * 1ULL * RC_TIMING_CAPACITOR_NF * (F_CPU / 1000) \
+    * RC_TIMING_THRESHOLD_LOG_PER_MILLE / 1000000000)
+
+/**
+ * Timer1 counts caused by the full potentiometer resistance, and the constant counts caused by the series resistor.
+ */
+#define RC_TIMING_FULL_SCALE_COUNTS RC_TIMING_COUNTS(AXIS_POTENTIOMETER_OHM)
+#define RC_TIMING_SERIES_COUNTS RC_TIMING_COUNTS(RC_TIMING_SERIES_RESISTOR_OHM)
+
+/**
+ * A measurement not finished after this many counts is taken as the maximum axis position. This happens if no
+ * joystick is connected.
+ */
+#define RC_TIMING_TIMEOUT_COUNTS (RC_TIMING_SERIES_COUNTS + RC_TIMING_FULL_SCALE_COUNTS \
+    + RC_TIMING_FULL_SCALE_COUNTS / 8)
+
+#if RC_TIMING_TIMEOUT_COUNTS > 65535
+#error "RC_TIMING_CAPACITOR_NF is too large for the 16 bit Timer1"
+#endif
+
+#define RC_TIMING_DISCHARGE_COUNTS (RC_TIMING_DISCHARGE_US * (F_CPU / 1000000))
+
+#if LOW_LATENCY_PROFILE && MEASUREMENTS_PER_FRAME * (RC_TIMING_TIMEOUT_COUNTS + RC_TIMING_DISCHARGE_COUNTS) \
+        > LOW_LATENCY_POLL_INTERVAL_MS * (F_CPU / 1000)
+#error "A frame takes longer than the poll interval. Use a smaller RC_TIMING_CAPACITOR_NF"
+#endif
+
+#if RC_TIMING_DISCHARGE_US < AXIS_MULTIPLEXER_SETTLE_US
+#error "The axis multiplexer settles while the capacitor is discharged, so RC_TIMING_DISCHARGE_US must cover its settle time"
+#endif
+
+/**
+ * Factor converting Timer1 counts to axis position steps, with 16 fractional bits.
+ */
+#define RC_TIMING_POSITION_SCALE ((uint16_t) ((((uint32_t) (AXIS_POSITION_MAX - AXIS_POSITION_MIN)) << 16) \
+    / RC_TIMING_FULL_SCALE_COUNTS))
+
+/* State of the measurement engine. Each measurement discharges the capacitor of the axis first, then lets it charge
+ * through the axis potentiometer until the comparator triggers the input capture.
+ */
+static uint8_t measured_axis;
+static uint8_t measured_axis_frame_end;
+static uint8_t discharging;
+
+
+/**
+ * Selects the next axis and starts discharging its capacitor.
+ * The compare match interrupt ending the discharge has to be enabled by the caller.
+ */
+static inline void start_discharge() {
+    measured_axis = joystick_schedule_next_axis(&measured_axis_frame_end);
+    /* Select the axis in the axis multiplexer (bits 3-5) and disconnect the resistor battery (bits 0-2), so that
+     * the capacitor only charges through the axis potentiometer. Keep the upper two bits of Port B.
+     */
+    PORTB = (PORTB & 0xC0) | RC_TIMING_RANGE_CHANNEL | measured_axis << 3;
+    /* PORTC4 is 0, so switching the pin to output shorts the capacitor to ground. The series resistor limits the
+     * current flowing in from the potentiometer meanwhile.
+     */
+    DDRC |= _BV(DDC4);
+    discharging = 1;
+    OCR1A = TCNT1 + RC_TIMING_DISCHARGE_COUNTS;
+    TIFR1 = _BV(OCF1A);
+}
+
+
+static inline void start_charge() {
+    // Count from the moment the capacitor is released.
+    TCNT1 = 0;
+    DDRC &= ~_BV(DDC4);
+    discharging = 0;
+    OCR1A = RC_TIMING_TIMEOUT_COUNTS;
+    TIFR1 = _BV(ICF1) | _BV(OCF1A);
+    TIMSK1 = _BV(ICIE1) | _BV(OCIE1A);
+}
+
+
+static inline void finish_measurement(const uint16_t counts) {
+    const uint8_t axis = measured_axis;
+    const uint8_t frame_end = measured_axis_frame_end;
+    // Discharge the next axis while the finished measurement is processed.
+    start_discharge();
+    // Remove the constant charge time through the series resistor.
+    const uint16_t potentiometer_counts = counts > RC_TIMING_SERIES_COUNTS ? counts - RC_TIMING_SERIES_COUNTS : 0;
+    const uint16_t position_offset = ((uint32_t) potentiometer_counts * RC_TIMING_POSITION_SCALE) >> 16;
+    const int16_t position = position_offset > AXIS_POSITION_MAX - AXIS_POSITION_MIN
+        ? AXIS_POSITION_MAX
+        : AXIS_POSITION_MIN + (int16_t) position_offset;
+    joystick_process_axis_measurement(axis, position, RC_TIMING_POSITION_SCALE >> 8, frame_end);
+    /* Only enable the Timer1 interrupts after the measurement is processed. Near the minimum position, the next
+     * measurement may finish before this, and processing it in a nested call would publish the frame while it is
+     * still being written. If the discharge ended in the meantime, the pending compare match is handled right away,
+     * which only extends the discharge.
+     */
+    TIMSK1 = _BV(OCIE1A);
+}
+
+
+ISR(TIMER1_CAPT_vect, ISR_NOBLOCK) {
+    /* Called when the capacitor voltage passes the bandgap reference. V-USB requires that the USB interrupt is never
+     * blocked for more than a few cycles, so this routine runs with interrupts enabled (ISR_NOBLOCK).
+     * Disable the Timer1 interrupts meanwhile, to not re-enter this routine.
+     */
+    TIMSK1 = 0;
+    finish_measurement(ICR1);
+}
+
+
+ISR(TIMER1_COMPA_vect, ISR_NOBLOCK) {
+    // Called when the capacitor is discharged, or when charging the capacitor timed out.
+    TIMSK1 = 0;
+    if (discharging) {
+        start_charge();
+    } else {
+        finish_measurement(RC_TIMING_TIMEOUT_COUNTS);
+    }
+}
+
+
+void rc_timing_start() {
+    /* Datasheet: 27.2.1. ADC Control and Status Register B, ACME:
+     * “When this bit is written logic one and the ADC is switched off (ADCSRA.ADEN is zero), the ADC multiplexer
+     *  selects the negative input to the Analog Comparator.”
+     * The ADC multiplexer is set to the axis input ADC4 by joystick_start_sampling().
+     * 
+     * Datasheet: 27.3.2. Analog Comparator Control and Status Register:
+     * - ACBG: “When this bit is set, a fixed bandgap reference voltage replaces the positive input to the Analog
+     *   Comparator.”
+     * - ACIC: “When written logic one, this bit enables the input capture function in Timer/Counter1 to be
+     *   triggered by the Analog Comparator.”
+     * The comparator output falls, when the capacitor voltage rises above the bandgap reference.
+     */
+    ADCSRA &= ~_BV(ADEN);
+    ADCSRB |= _BV(ACME);
+    ACSR = _BV(ACBG) | _BV(ACIC);
+
+    /* Datasheet: 20.14.2. TC1 Control Register B, page 173:
+     * Run Timer1 in normal mode with the CPU clock, capturing on the falling edge (ICES1 = 0).
+     * The noise canceler (ICNC1) requires four equal comparator samples, which delays each capture by a constant
+     * 4 CPU cycles.
+     */
+    TCCR1A = 0;
+    TCCR1B = _BV(ICNC1) | _BV(CS10);
+    start_discharge();
+    TIMSK1 = _BV(OCIE1A);
+}
+
+#endif
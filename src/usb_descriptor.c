@@ -18,35 +18,95 @@
 
 #include <avr/pgmspace.h>
 
+#include "usb_descriptor.h"
+
 /* Values automatically generated using the USB HID descriptor generator tool from usb.org
+ * 
+ * The items of a joystick are listed once and used for each joystick. With multiple joysticks, each joystick is
+ * a separate application collection with its own report ID.
+ * With BUTTON_REPORT, a second report ID item moves the button and hat switch items into the button report,
+ * so the axis report only contains the axis. No usage is declared in both reports.
  */
 
-const PROGMEM uint8_t usbDescriptorHidReport[54] = {
+#define JOYSTICK_AXIS_ITEMS \
+    0x05, 0x01,                    /*     USAGE_PAGE (Generic Desktop) */ \
+    0x09, 0x30,                    /*     USAGE (X) */ \
+    0x09, 0x31,                    /*     USAGE (Y) */ \
+    0x09, 0x32,                    /*     USAGE (Z) */ \
+    0x09, 0x33,                    /*     USAGE (Rx) */ \
+    0x16, 0x01, 0xf8,              /*     LOGICAL_MINIMUM (-2047) */ \
+    0x26, 0xff, 0x07,              /*     LOGICAL_MAXIMUM (2047) */ \
+    0x75, 0x0c,                    /*     REPORT_SIZE (12) */ \
+    0x95, 0x04,                    /*     REPORT_COUNT (4) */ \
+    0x81, 0x02,                    /*     INPUT (Data,Var,Abs) */
+
+#define JOYSTICK_BUTTON_ITEMS \
+    0x05, 0x09,                    /*     USAGE_PAGE (Button) */ \
+    0x19, 0x01,                    /*     USAGE_MINIMUM (Button 1) */ \
+    0x29, JOYSTICK_BUTTON_COUNT,   /*     USAGE_MAXIMUM (Button 4 or 8) */ \
+    0x15, 0x00,                    /*     LOGICAL_MINIMUM (0) */ \
+    0x25, 0x01,                    /*     LOGICAL_MAXIMUM (1) */ \
+    0x75, 0x01,                    /*     REPORT_SIZE (1) */ \
+    0x95, JOYSTICK_BUTTON_COUNT,   /*     REPORT_COUNT (4 or 8) */ \
+    0x81, 0x02,                    /*     INPUT (Data,Var,Abs) */
+
+#if JOYSTICK_BUTTON_COUNT == 8
+// The buttons fill the whole byte, so no padding is needed.
+#define JOYSTICK_BUTTON_PADDING_ITEMS
+#elif HAT_SWITCH_AXIS
+#define JOYSTICK_BUTTON_PADDING_ITEMS \
+    0x05, 0x01,                    /*     USAGE_PAGE (Generic Desktop) */ \
+    0x09, 0x39,                    /*     USAGE (Hat switch) */ \
+    0x15, 0x00,                    /*     LOGICAL_MINIMUM (0) */ \
+    0x25, 0x07,                    /*     LOGICAL_MAXIMUM (7) */ \
+    0x35, 0x00,                    /*     PHYSICAL_MINIMUM (0) */ \
+    0x46, 0x3b, 0x01,              /*     PHYSICAL_MAXIMUM (315) */ \
+    0x65, 0x14,                    /*     UNIT (Eng Rot:Angular Pos) */ \
+    0x75, 0x04,                    /*     REPORT_SIZE (4) */ \
+    0x95, 0x01,                    /*     REPORT_COUNT (1) */ \
+    0x81, 0x42,                    /*     INPUT (Data,Var,Abs,Null) */ \
+    0x65, 0x00,                    /*     UNIT (None) */ \
+    0x45, 0x00,                    /*     PHYSICAL_MAXIMUM (0) */
+#else
+#define JOYSTICK_BUTTON_PADDING_ITEMS \
+    0x95, 0x01,                    /*     REPORT_COUNT (1) */ \
+    0x75, 0x04,                    /*     REPORT_SIZE (4) */ \
+    0x81, 0x03,                    /*     INPUT (Cnst,Var,Abs) */
+#endif
+
+#if BUTTON_REPORT
+#define BUTTON_REPORT_ID_ITEMS(joystick) \
+    0x85, BUTTON_REPORT_ID(joystick), /*     REPORT_ID (button report) */
+#else
+#define BUTTON_REPORT_ID_ITEMS(joystick)
+#endif
+
+#define JOYSTICK_ITEMS(joystick) \
+    0xa1, 0x00,                    /*   COLLECTION (Physical) */ \
+    JOYSTICK_AXIS_ITEMS \
+    BUTTON_REPORT_ID_ITEMS(joystick) \
+    JOYSTICK_BUTTON_ITEMS \
+    JOYSTICK_BUTTON_PADDING_ITEMS \
+    0xc0,                          /*   END_COLLECTION */
+
+const PROGMEM uint8_t usbDescriptorHidReport[] = {
     0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
     0x09, 0x04,                    // USAGE (Joystick)
     0xa1, 0x01,                    // COLLECTION (Application)
-    0xa1, 0x00,                    //   COLLECTION (Physical)
-    0x05, 0x01,                    //     USAGE_PAGE (Generic Desktop)
-    0x09, 0x30,                    //     USAGE (X)
-    0x09, 0x31,                    //     USAGE (Y)
-    0x09, 0x32,                    //     USAGE (Z)
-    0x09, 0x33,                    //     USAGE (Rx)
-    0x16, 0x01, 0xf8,              //     LOGICAL_MINIMUM (-2047)
-    0x26, 0xff, 0x07,              //     LOGICAL_MAXIMUM (2047)
-    0x75, 0x10,                    //     REPORT_SIZE (16)
-    0x95, 0x04,                    //     REPORT_COUNT (4)
-    0x81, 0x02,                    //     INPUT (Data,Var,Abs)
-    0x05, 0x09,                    //     USAGE_PAGE (Button)
-    0x19, 0x01,                    //     USAGE_MINIMUM (Button 1)
-    0x29, 0x04,                    //     USAGE_MAXIMUM (Button 4)
-    0x15, 0x00,                    //     LOGICAL_MINIMUM (0)
-    0x25, 0x01,                    //     LOGICAL_MAXIMUM (1)
-    0x75, 0x01,                    //     REPORT_SIZE (1)
-    0x95, 0x04,                    //     REPORT_COUNT (4)
-    0x81, 0x02,                    //     INPUT (Data,Var,Abs)
-    0x95, 0x01,                    //     REPORT_COUNT (1)
-    0x75, 0x04,                    //     REPORT_SIZE (4)
-    0x81, 0x03,                    //     INPUT (Cnst,Var,Abs)
-    0xc0,                          //   END_COLLECTION
-    0xc0                           // END_COLLECTION
+#if REPORT_IDS
+    0x85, JOYSTICK_REPORT_ID(0),   //   REPORT_ID (1)
+#endif
+    JOYSTICK_ITEMS(0)
+    0xc0,                          // END_COLLECTION
+#if JOYSTICK_COUNT > 1
+    0x05, 0x01,                    // USAGE_PAGE (Generic Desktop)
+    0x09, 0x04,                    // USAGE (Joystick)
+    0xa1, 0x01,                    // COLLECTION (Application)
+    0x85, JOYSTICK_REPORT_ID(1),   //   REPORT_ID (2)
+    JOYSTICK_ITEMS(1)
+    0xc0,                          // END_COLLECTION
+#endif
 };
+
+_Static_assert(sizeof(usbDescriptorHidReport) == USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH,
+        "USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH does not match the report descriptor");
@@ -10,6 +10,8 @@
 #ifndef __usbconfig_h_included__
 #define __usbconfig_h_included__
 
+#include "joystick_config.h"
+
 
 /* ---------------------------- Hardware Config ---------------------------- */
 
@@ -97,10 +99,16 @@
  * (e.g. HID), but never want to send any data. This option saves a couple
  * of bytes in flash memory and the transmit buffers in RAM.
  */
-#define USB_CFG_INTR_POLL_INTERVAL      100
+#if LOW_LATENCY_PROFILE
+#define USB_CFG_INTR_POLL_INTERVAL      LOW_LATENCY_POLL_INTERVAL_MS
+#else
+#define USB_CFG_INTR_POLL_INTERVAL      (100 / JOYSTICK_COUNT)
+#endif
 /* If you compile a version with endpoint 1 (interrupt-in), this is the poll
  * interval. The value is in milliseconds and must not be less than 10 ms for
  * low speed devices.
+ * The joysticks take turns in sending their reports, so the interval is divided by the number of joysticks.
+ * That way, each joystick keeps its report rate. The low latency profile uses the shortest interval instead.
  */
 #define USB_CFG_IS_SELF_POWERED         0
 /* Define this to 1 if the device has its own power supply. Set it to 0 if the
@@ -159,10 +167,18 @@
 /* This macro (if defined) is executed when a USB SET_ADDRESS request was
  * received.
  */
-#define USB_COUNT_SOF                   0
+#define USB_COUNT_SOF                   SOF_TIMEBASE
 /* define this macro to 1 if you need the global variable "usbSofCount" which
  * counts SOF packets. This feature requires that the hardware interrupt is
  * connected to D- instead of D+.
+ * With SOF_TIMEBASE, the pin change interrupt of D- is used, see the optional
+ * MCU description below.
+ */
+#define USB_SOF_CLEAR_PENDING           SOF_TIMEBASE
+/* Define this to 1, if the USB interrupt triggers on both edges of D-, like a
+ * pin change interrupt. The rising edge at the end of each SOF (keep-alive)
+ * signal then raises the interrupt again, so the SOF code clears the pending
+ * flag. Otherwise, each SOF would be counted twice.
  */
 /* #ifdef __ASSEMBLER__
  * macro myAssemblerMacro
@@ -259,7 +275,19 @@
  * HID class is 3, no subclass and protocol required (but may be useful!)
  * CDC class is 2, use subclass 2 and protocol 1 for ACM
  */
-#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    54
+/* Length of the report descriptor part of a single joystick. With multiple joysticks, each has its own
+ * application collection (8 bytes including the usage). With report IDs, the axis report has a report ID item
+ * (2 bytes). With BUTTON_REPORT, the buttons are moved to the button report by another report ID item (2 bytes).
+ */
+#if JOYSTICK_BUTTON_COUNT == 8
+#define JOYSTICK_REPORT_DESCRIPTOR_LENGTH       48
+#elif HAT_SWITCH_AXIS
+#define JOYSTICK_REPORT_DESCRIPTOR_LENGTH       73
+#else
+#define JOYSTICK_REPORT_DESCRIPTOR_LENGTH       54
+#endif
+#define USB_CFG_HID_REPORT_DESCRIPTOR_LENGTH    (JOYSTICK_COUNT * (JOYSTICK_REPORT_DESCRIPTOR_LENGTH \
+        + (REPORT_IDS ? 2 : 0) + (BUTTON_REPORT ? 2 : 0)))
 /* Define this to the length of the HID report descriptor, if you implement
  * an HID device. Otherwise don't define it or define it to 0.
  * If you use this define, you must add a PROGMEM character array named
@@ -360,5 +388,18 @@
 /* #define USB_INTR_PENDING        GIFR */
 /* #define USB_INTR_PENDING_BIT    INTF0 */
 /* #define USB_INTR_VECTOR         INT0_vect */
+#if SOF_TIMEBASE
+/* Use the pin change interrupt of D- (PCINT20 on Port D 4) to see the SOF
+ * (keep-alive) signals, which do not change D+.
+ */
+#define USB_INTR_CFG            PCMSK2
+#define USB_INTR_CFG_SET        (1 << PCINT20)
+#define USB_INTR_CFG_CLR        0
+#define USB_INTR_ENABLE         PCICR
+#define USB_INTR_ENABLE_BIT     PCIE2
+#define USB_INTR_PENDING        PCIFR
+#define USB_INTR_PENDING_BIT    PCIF2
+#define USB_INTR_VECTOR         PCINT2_vect
+#endif
 
 #endif /* __usbconfig_h_included__ */